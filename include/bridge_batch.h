@@ -0,0 +1,240 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Multi-message I/O of the bridge character devices
+ *
+ * read_iter()/write_iter() take each iovec as one message, so readv() and
+ * writev() move a message per segment and io_uring gets an async path. A
+ * received message longer than its iovec is truncated, a shorter one leaves
+ * the rest of the iovec untouched; use BRIDGE_IOC_RECV_BATCH when the
+ * length of every message matters. A message whose copy faults is lost,
+ * see bridge_ioctl.h.
+ *
+ * Only the first message of a read may wait, the rest are taken while the
+ * reader has them pending.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_BATCH_H
+#define _BRIDGE_BATCH_H
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/uaccess.h>
+
+#include "bridge_ioctl.h"
+#include "bridge_msgq.h"
+
+/* sends one message to the remote, returns 0 or error */
+typedef int (*bridge_send_t)(void *priv, void *data, int len);
+
+/**
+ * @brief Read one message per iovec
+ * @param r Reader
+ * @param to Destination, one segment per message
+ * @param nonblock Return -EAGAIN instead of waiting for the first message
+ * @return Number of bytes read or error
+ */
+static inline ssize_t bridge_read_iter(struct bridge_msgq_reader *r, struct iov_iter *to,
+				       bool nonblock)
+{
+	struct bridge_msgq_msg *msg;
+	ssize_t done = 0;
+	size_t seg, n;
+
+	while (iov_iter_count(to)) {
+		seg = iov_iter_single_seg_count(to);
+		if (!seg) {
+			// an empty iovec does not advance the iterator, it ends the read
+			break;
+		}
+
+		msg = done ? bridge_msgq_pop(r) : bridge_msgq_wait_pop(r, nonblock);
+		if (IS_ERR_OR_NULL(msg)) {
+			return done ? done : PTR_ERR(msg);
+		}
+
+		n = min_t(size_t, seg, msg->len);
+		if (copy_to_iter(msg->data, n, to) != n) {
+			bridge_msgq_put(msg);
+			return done ? done : -EFAULT;
+		}
+		bridge_msgq_put(msg);
+		done += n;
+
+		iov_iter_advance(to, seg - n);
+	}
+
+	return done;
+}
+
+/**
+ * @brief Send one message per iovec
+ * @param from Source, one segment per message
+ * @param max_len Largest message accepted
+ * @param send Sends a message to the remote
+ * @param priv Argument of send
+ * @return Number of bytes sent or error
+ */
+static inline ssize_t bridge_write_iter(struct iov_iter *from, int max_len, bridge_send_t send,
+					void *priv)
+{
+	ssize_t done = 0;
+	size_t seg;
+	void *buf;
+	int ret = 0;
+
+	buf = kmalloc(max_len, GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	while (iov_iter_count(from)) {
+		seg = iov_iter_single_seg_count(from);
+		if (!seg) {
+			break;
+		}
+		if (seg > max_len) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		if (copy_from_iter(buf, seg, from) != seg) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = send(priv, buf, seg);
+		if (ret) {
+			break;
+		}
+		done += seg;
+	}
+
+	kfree(buf);
+
+	return done ? done : ret;
+}
+
+static inline int bridge_batch_get(struct bridge_batch *batch, void __user *arg)
+{
+	if (copy_from_user(batch, arg, sizeof(*batch))) {
+		return -EFAULT;
+	}
+	if (batch->flags || batch->count > BRIDGE_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief BRIDGE_IOC_SUBMIT_BATCH, send an array of messages
+ * @param arg User pointer to struct bridge_batch
+ * @param max_len Largest message accepted
+ * @param send Sends a message to the remote
+ * @param priv Argument of send
+ * @return Number of messages sent or error
+ *
+ * Stops at the first message that fails, the ones before it were sent.
+ */
+static inline int bridge_submit_batch(void __user *arg, int max_len, bridge_send_t send,
+				      void *priv)
+{
+	struct bridge_msg __user *umsgs;
+	struct bridge_batch batch;
+	struct bridge_msg m;
+	unsigned int i;
+	void *buf;
+	int ret;
+
+	ret = bridge_batch_get(&batch, arg);
+	if (ret) {
+		return ret;
+	}
+	umsgs = u64_to_user_ptr(batch.msgs);
+
+	buf = kmalloc(max_len, GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (copy_from_user(&m, &umsgs[i], sizeof(m))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (m.len > max_len) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		if (copy_from_user(buf, u64_to_user_ptr(m.buf), m.len)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = send(priv, buf, m.len);
+		if (ret) {
+			break;
+		}
+	}
+
+	kfree(buf);
+
+	return i ? i : ret;
+}
+
+/**
+ * @brief BRIDGE_IOC_RECV_BATCH, read pending messages into an array
+ * @param r Reader
+ * @param arg User pointer to struct bridge_batch
+ * @param nonblock Return -EAGAIN instead of waiting for the first message
+ * @return Number of messages read or error
+ *
+ * len of every entry read is set to the bytes stored, BRIDGE_MSG_TRUNC
+ * flags a message that did not fit. A message whose copy faults after the
+ * checks is lost.
+ */
+static inline int bridge_recv_batch(struct bridge_msgq_reader *r, void __user *arg, bool nonblock)
+{
+	struct bridge_msg __user *umsgs;
+	struct bridge_msgq_msg *msg;
+	struct bridge_batch batch;
+	struct bridge_msg m;
+	unsigned int i;
+	int ret;
+
+	ret = bridge_batch_get(&batch, arg);
+	if (ret) {
+		return ret;
+	}
+	umsgs = u64_to_user_ptr(batch.msgs);
+
+	for (i = 0; i < batch.count; i++) {
+		// validate the entry and its buffer before moving the cursor
+		if (copy_from_user(&m, &umsgs[i], sizeof(m)) ||
+		    !access_ok(u64_to_user_ptr(m.buf), m.len)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		msg = i ? bridge_msgq_pop(r) : bridge_msgq_wait_pop(r, nonblock);
+		if (IS_ERR_OR_NULL(msg)) {
+			ret = PTR_ERR(msg);
+			break;
+		}
+
+		m.flags = msg->len > m.len ? BRIDGE_MSG_TRUNC : 0;
+		m.len = min_t(u32, m.len, msg->len);
+		ret = copy_to_user(u64_to_user_ptr(m.buf), msg->data, m.len) ||
+		      copy_to_user(&umsgs[i], &m, sizeof(m)) ? -EFAULT : 0;
+		bridge_msgq_put(msg);
+		if (ret) {
+			break;
+		}
+	}
+
+	return i ? i : ret;
+}
+
+#endif /* _BRIDGE_BATCH_H */
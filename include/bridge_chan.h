@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Channel table of the rpmsg bridge modules
+ *
+ * Every probed rpmsg channel of a module is an instance with its own state,
+ * registered here under a small id. Lookups from userspace run under SRCU,
+ * so the send path may sleep in rpmsg_send() while remove() waits for it
+ * before tearing the channel down.
+ *
+ * Netlink clients pick the channel with BRIDGE_ATTR_CHANNEL, see
+ * bridge_genl.h.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_CHAN_H
+#define _BRIDGE_CHAN_H
+
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+
+#define BRIDGE_MAX_CHANNELS 8
+
+struct bridge_chan_table {
+	struct mutex lock; /* protects used */
+	DECLARE_BITMAP(used, BRIDGE_MAX_CHANNELS);
+	struct srcu_struct srcu;
+	void __rcu *chans[BRIDGE_MAX_CHANNELS];
+};
+
+static inline int bridge_chan_table_init(struct bridge_chan_table *t)
+{
+	mutex_init(&t->lock);
+	return init_srcu_struct(&t->srcu);
+}
+
+static inline void bridge_chan_table_destroy(struct bridge_chan_table *t)
+{
+	cleanup_srcu_struct(&t->srcu);
+}
+
+/**
+ * @brief Reserve an id for a channel
+ * @param t Table
+ * @return Id or -ENOSPC
+ *
+ * The channel is not visible until bridge_chan_publish().
+ */
+static inline int bridge_chan_alloc(struct bridge_chan_table *t)
+{
+	int id;
+
+	mutex_lock(&t->lock);
+	id = find_first_zero_bit(t->used, BRIDGE_MAX_CHANNELS);
+	if (id < BRIDGE_MAX_CHANNELS) {
+		set_bit(id, t->used);
+	} else {
+		id = -ENOSPC;
+	}
+	mutex_unlock(&t->lock);
+
+	return id;
+}
+
+/**
+ * @brief Release the id of a channel that is not published
+ * @param t Table
+ * @param id Id of the channel
+ */
+static inline void bridge_chan_free(struct bridge_chan_table *t, int id)
+{
+	mutex_lock(&t->lock);
+	clear_bit(id, t->used);
+	mutex_unlock(&t->lock);
+}
+
+static inline void bridge_chan_publish(struct bridge_chan_table *t, int id, void *chan)
+{
+	rcu_assign_pointer(t->chans[id], chan);
+}
+
+/**
+ * @brief Hide a channel and wait until no lookup uses it
+ * @param t Table
+ * @param id Id of the channel, released with bridge_chan_free() once torn down
+ */
+static inline void bridge_chan_del(struct bridge_chan_table *t, int id)
+{
+	RCU_INIT_POINTER(t->chans[id], NULL);
+	synchronize_srcu(&t->srcu);
+}
+
+/**
+ * @brief Look up a channel, within srcu_read_lock(&t->srcu)
+ * @param t Table
+ * @param id Id of the channel
+ * @return Channel or NULL
+ */
+static inline void *bridge_chan_get(struct bridge_chan_table *t, int id)
+{
+	if (id < 0 || id >= BRIDGE_MAX_CHANNELS) {
+		return NULL;
+	}
+
+	return srcu_dereference(t->chans[id], &t->srcu);
+}
+
+#endif /* _BRIDGE_CHAN_H */
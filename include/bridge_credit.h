@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Credit based flow control from the remote to the bridges
+ *
+ * The remote may only send a message while it holds a credit. Linux grants
+ * as many credits as it has room to keep messages until userspace takes
+ * them, and grants more as userspace consumes them. A missing or slow client
+ * throttles the remote at the source instead of having its messages dropped
+ * here, and the vrings only carry messages somebody will read.
+ *
+ * A grant is a struct bridge_credit_grant sent as a message of its own,
+ * framed like any other message of the channel, and typed BRIDGE_WIRE_CREDIT
+ * when the wire header of bridge_wire.h is on. It carries the number of
+ * messages the remote may have sent since the channel started, wrapping at
+ * 2^32, so a lost grant is repaired by the next one. The remote sends while
+ * its own count is below the limit and waits for a grant otherwise. Credits
+ * count whole data messages, the fragments of a message share its credit.
+ *
+ * A consumer that is there but can not take a message, like a netlink
+ * socket with a full receive buffer, gives its credit back and the message
+ * is counted as dropped, so the remote never waits for a grant nobody sends.
+ * The mmap'able rx ring (bridge_mmap.h) is such a consumer: its credits come
+ * back when the message is written, not when userspace consumes it.
+ *
+ * Time the remote spends with no credit left is accounted as stall time.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_CREDIT_H
+#define _BRIDGE_CREDIT_H
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+
+#define BRIDGE_CREDIT_MAGIC 0x44524342 /* "BCRD" */
+
+struct bridge_credit_grant {
+	__le32 magic;
+	__le32 limit; /* messages the remote may have sent in total */
+} __packed;
+
+struct bridge_credit {
+	spinlock_t lock; /* protects everything below but the counters of the worker */
+	u32 window;
+	u32 threshold; /* credits returned before a grant is worth a message */
+	u32 received;  /* messages from the remote */
+	u32 consumed;  /* of those, taken by userspace */
+	u32 limit;     /* last limit granted */
+	bool stopped;
+	bool stalled;
+	ktime_t stall_start;
+	struct delayed_work work;
+	int (*send)(struct bridge_credit *c, void *msg, int len);
+
+	/* counters */
+	u64 grants;
+	u64 overruns; /* messages sent past the limit */
+	u64 drops;    /* messages a consumer could not take */
+	u64 stalls;
+	u64 stall_ns;
+};
+
+/**
+ * @brief Send the current limit to the remote, runs in the system workqueue
+ * @param work Work of the credits
+ */
+static inline void bridge_credit_work(struct work_struct *work)
+{
+	struct bridge_credit *c = container_of(to_delayed_work(work), struct bridge_credit, work);
+	struct bridge_credit_grant grant;
+	unsigned long flags;
+	u32 limit;
+
+	spin_lock_irqsave(&c->lock, flags);
+	// counted from now on, the remote may answer before send returns
+	limit = c->consumed + c->window;
+	c->limit = limit;
+	if (c->stalled && c->limit != c->received) {
+		c->stalled = false;
+		c->stall_ns += ktime_to_ns(ktime_sub(ktime_get(), c->stall_start));
+	}
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	grant.magic = cpu_to_le32(BRIDGE_CREDIT_MAGIC);
+	grant.limit = cpu_to_le32(limit);
+	if (c->send(c, &grant, sizeof(grant))) {
+		// tx queue full or no free buffer, the next try sends the newest limit
+		if (!READ_ONCE(c->stopped)) {
+			schedule_delayed_work(&c->work, 1);
+		}
+		return;
+	}
+	c->grants++;
+}
+
+/**
+ * @brief Schedule a grant if enough credits came back, with the lock held
+ * @param c Credits
+ *
+ * A remote out of credits gets them back right away, otherwise grants are
+ * batched.
+ */
+static inline void bridge_credit_update(struct bridge_credit *c)
+{
+	u32 returned = c->consumed + c->window - c->limit;
+
+	if (c->stopped || !returned) {
+		return;
+	}
+	if (returned >= c->threshold || c->stalled) {
+		mod_delayed_work(system_wq, &c->work, 0);
+	}
+}
+
+/**
+ * @brief Account a message from the remote, runs in the rx worker
+ * @param c Credits
+ */
+static inline void bridge_credit_rx(struct bridge_credit *c)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->lock, flags);
+	if ((s32)(c->received - c->limit) >= 0) {
+		// the remote ignores its credits, the message is delivered anyway
+		c->overruns++;
+	}
+	c->received++;
+	if (c->received == c->limit && !c->stalled) {
+		c->stalled = true;
+		c->stall_start = ktime_get();
+		c->stalls++;
+	}
+	spin_unlock_irqrestore(&c->lock, flags);
+}
+
+/**
+ * @brief Return the credits of messages userspace took
+ * @param c Credits
+ * @param n Messages taken
+ */
+static inline void bridge_credit_consume(struct bridge_credit *c, unsigned int n)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->lock, flags);
+	c->consumed += min_t(u32, n, c->received - c->consumed);
+	bridge_credit_update(c);
+	spin_unlock_irqrestore(&c->lock, flags);
+}
+
+/**
+ * @brief Return the credits of every message received so far
+ * @param c Credits
+ *
+ * For consumers that take messages as they are delivered, or that just
+ * showed up and make the messages held back until now irrelevant.
+ */
+static inline void bridge_credit_consume_all(struct bridge_credit *c)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->lock, flags);
+	c->consumed = c->received;
+	bridge_credit_update(c);
+	spin_unlock_irqrestore(&c->lock, flags);
+}
+
+/**
+ * @brief Return the credits of a message a consumer could not take
+ * @param c Credits
+ *
+ * Like bridge_credit_consume_all(), the consumer gets the messages that
+ * follow instead of the ones held back.
+ */
+static inline void bridge_credit_drop(struct bridge_credit *c)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->lock, flags);
+	c->drops++;
+	c->consumed = c->received;
+	bridge_credit_update(c);
+	spin_unlock_irqrestore(&c->lock, flags);
+}
+
+/**
+ * @brief Set up the credits of an endpoint
+ * @param c Credits
+ * @param window Messages the remote may send ahead of userspace
+ * @param send Sends a grant to the remote, failing instead of waiting for a tx buffer
+ */
+static inline void bridge_credit_init(struct bridge_credit *c, u32 window,
+				      int (*send)(struct bridge_credit *c, void *msg, int len))
+{
+	spin_lock_init(&c->lock);
+	c->window = max(window, 1U);
+	c->threshold = max(c->window / 4, 1U);
+	c->send = send;
+	INIT_DELAYED_WORK(&c->work, bridge_credit_work);
+}
+
+/**
+ * @brief Send the first grant, the remote sends nothing before it
+ * @param c Credits
+ */
+static inline void bridge_credit_start(struct bridge_credit *c)
+{
+	mod_delayed_work(system_wq, &c->work, 0);
+}
+
+/**
+ * @brief Stop sending grants
+ * @param c Credits
+ */
+static inline void bridge_credit_destroy(struct bridge_credit *c)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->lock, flags);
+	c->stopped = true;
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	cancel_delayed_work_sync(&c->work);
+}
+
+static inline u64 bridge_credit_stall_us(struct bridge_credit *c)
+{
+	return div_u64(c->stall_ns, NSEC_PER_USEC);
+}
+
+static inline void bridge_credit_show(struct seq_file *s, struct bridge_credit *c)
+{
+	seq_printf(s, "cr_credits:   %d/%u\n", (s32)(READ_ONCE(c->limit) - READ_ONCE(c->received)),
+		   c->window);
+	seq_printf(s, "cr_grants:    %llu\n", c->grants);
+	seq_printf(s, "cr_overruns:  %llu\n", c->overruns);
+	seq_printf(s, "cr_drops:     %llu\n", c->drops);
+	seq_printf(s, "cr_stalls:    %llu\n", c->stalls);
+	seq_printf(s, "cr_stall_us:  %llu\n", bridge_credit_stall_us(c));
+}
+
+#endif /* _BRIDGE_CREDIT_H */
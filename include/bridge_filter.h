@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Message filters of the bridge subscribers
+ *
+ * A filter decides in the kernel whether a subscriber gets a message from
+ * the remote, before any skb is built for it or any reader is woken up.
+ * It either compares the bytes at some offset of the message with a
+ * prefix, which also selects on a message type kept in the first bytes,
+ * or runs a classic BPF program over the message like a socket filter
+ * over a packet: loads address the message, BPF_LEN is its size and a
+ * return value of 0 drops it.
+ *
+ * Programs go through the same loader as SO_ATTACH_FILTER when they are
+ * attached, which checks them and converts them for the kernel BPF runtime
+ * or JIT. They run over a copy of the message in an skb of its own, with the
+ * network header at the start of the message; ancillary loads see an skb
+ * that belongs to no device or socket. The copy is the price of running
+ * untrusted programs on the kernel's own engine, prefix filters avoid it.
+ *
+ * Filters are freed from an RCU callback, modules using them call
+ * rcu_barrier() before they go away.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_FILTER_H
+#define _BRIDGE_FILTER_H
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/filter.h>
+#include <linux/skbuff.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+
+#include "bridge_ioctl.h"
+
+struct bridge_filter {
+	struct rcu_head rcu;
+	u16 offset;
+	u16 prefix_len;
+	u8 prefix[BRIDGE_FILTER_PREFIX_MAX];
+	struct bpf_prog *prog; /* NULL for a prefix filter */
+};
+
+/**
+ * @brief Build a prefix filter
+ * @param offset Offset of the prefix in the message
+ * @param prefix Bytes to compare
+ * @param len Size of the prefix, up to BRIDGE_FILTER_PREFIX_MAX
+ * @return Filter or ERR_PTR()
+ */
+static inline struct bridge_filter *bridge_filter_prefix(u16 offset, const u8 *prefix, u16 len)
+{
+	struct bridge_filter *f;
+
+	if (len > BRIDGE_FILTER_PREFIX_MAX) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f) {
+		return ERR_PTR(-ENOMEM);
+	}
+	f->offset = offset;
+	f->prefix_len = len;
+	memcpy(f->prefix, prefix, len);
+
+	return f;
+}
+
+/**
+ * @brief Wrap a loaded program into a filter
+ * @param prog Program, destroyed on failure
+ * @return Filter or ERR_PTR()
+ */
+static inline struct bridge_filter *bridge_filter_prog(struct bpf_prog *prog)
+{
+	struct bridge_filter *f;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f) {
+		bpf_prog_destroy(prog);
+		return ERR_PTR(-ENOMEM);
+	}
+	f->prog = prog;
+
+	return f;
+}
+
+/**
+ * @brief Build a classic BPF filter
+ * @param insns Program, in kernel memory
+ * @param len Instructions in the program
+ * @return Filter or ERR_PTR()
+ */
+static inline struct bridge_filter *bridge_filter_bpf(struct sock_filter *insns, unsigned int len)
+{
+	struct sock_fprog_kern fprog = {
+		.len = len,
+		.filter = insns,
+	};
+	struct bpf_prog *prog;
+	int ret;
+
+	if (!len || len > BPF_MAXINSNS) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	ret = bpf_prog_create(&prog, &fprog);
+	if (ret) {
+		return ERR_PTR(ret);
+	}
+
+	return bridge_filter_prog(prog);
+}
+
+/**
+ * @brief Build the filter described by userspace
+ * @param info Filter from BRIDGE_IOC_SET_FILTER
+ * @return Filter, NULL for BRIDGE_FILTER_NONE, or ERR_PTR()
+ */
+static inline struct bridge_filter *bridge_filter_from_user(const struct bridge_filter_info *info)
+{
+	struct sock_fprog fprog;
+	struct bpf_prog *prog;
+	int ret;
+
+	switch (info->kind) {
+	case BRIDGE_FILTER_NONE:
+		return NULL;
+	case BRIDGE_FILTER_PREFIX:
+		return bridge_filter_prefix(info->offset, info->prefix, info->len);
+	case BRIDGE_FILTER_BPF:
+		if (!info->len || info->len > BPF_MAXINSNS) {
+			return ERR_PTR(-EINVAL);
+		}
+		fprog.len = info->len;
+		fprog.filter = u64_to_user_ptr(info->insns);
+		ret = bpf_prog_create_from_user(&prog, &fprog, NULL, false);
+		if (ret) {
+			return ERR_PTR(ret);
+		}
+		return bridge_filter_prog(prog);
+	default:
+		return ERR_PTR(-EINVAL);
+	}
+}
+
+static inline void bridge_filter_release_rcu(struct rcu_head *rcu)
+{
+	struct bridge_filter *f = container_of(rcu, struct bridge_filter, rcu);
+
+	if (f->prog) {
+		bpf_prog_destroy(f->prog);
+	}
+	kfree(f);
+}
+
+static inline void bridge_filter_free(struct bridge_filter *f)
+{
+	if (f) {
+		call_rcu(&f->rcu, bridge_filter_release_rcu);
+	}
+}
+
+/**
+ * @brief Replace a filter read under RCU
+ * @param slot Filter in use
+ * @param f New filter, NULL to drop every filter
+ *
+ * The old filter is freed once the readers are done with it.
+ */
+static inline void bridge_filter_swap(struct bridge_filter __rcu **slot, struct bridge_filter *f)
+{
+	struct bridge_filter *old;
+
+	old = (__force struct bridge_filter *)xchg((__force struct bridge_filter **)slot, f);
+	bridge_filter_free(old);
+}
+
+/**
+ * @brief Run a classic BPF program over a message
+ * @param f Filter with a program
+ * @param data Message
+ * @param len Size of the message
+ * @return Value returned by the program, 0 if no skb could be had
+ *
+ * May be called with a spinlock held.
+ */
+static inline u32 bridge_filter_run(const struct bridge_filter *f, const void *data, int len)
+{
+	struct sk_buff *skb;
+	u32 res;
+
+	skb = alloc_skb(len, GFP_ATOMIC);
+	if (!skb) {
+		return 0;
+	}
+	skb_put_data(skb, data, len);
+	skb_reset_network_header(skb);
+
+	res = bpf_prog_run_pin_on_cpu(f->prog, skb);
+	consume_skb(skb);
+
+	return res;
+}
+
+/**
+ * @brief Check a message against a filter
+ * @param f Filter, NULL lets every message through
+ * @param data Message
+ * @param len Size of the message
+ * @return true if the subscriber gets the message
+ */
+static inline bool bridge_filter_match(const struct bridge_filter *f, const void *data, int len)
+{
+	if (!f) {
+		return true;
+	}
+
+	if (f->prog) {
+		return bridge_filter_run(f, data, len) != 0;
+	}
+
+	return f->offset <= len && len - f->offset >= f->prefix_len &&
+	       !memcmp((const u8 *)data + f->offset, f->prefix, f->prefix_len);
+}
+
+#endif /* _BRIDGE_FILTER_H */
@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Fragmentation layer shared by the rpmsg bridge modules
+ *
+ * Every message on the channel starts with a small header, messages longer
+ * than the mtu are split in fragments carrying the same id. Fragments of a
+ * message are sent in order, but fragments of different messages may be
+ * interleaved, so the receiver keeps a few reassembly contexts keyed by id.
+ * Contexts have a fixed maximum size and are dropped when the rest of the
+ * message does not arrive in time.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_FRAG_H
+#define _BRIDGE_FRAG_H
+
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/rpmsg.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/seq_file.h>
+
+#define BRIDGE_FRAG_CONTEXTS 4
+
+struct bridge_frag_hdr {
+	__le16 msg_id;
+	__le16 index;
+	__le16 count;
+	__le16 reserved;
+	__le32 total_len;
+} __packed;
+
+struct bridge_frag_ctx {
+	bool busy;
+	u16 msg_id;
+	u16 next;
+	u16 count;
+	u32 total_len;
+	u32 len;
+	unsigned long deadline;
+	u8 *buf;
+};
+
+struct bridge_frag {
+	atomic_t tx_id;
+	u32 max_len;
+	unsigned long timeout;
+
+	/* only used by the rx worker */
+	struct bridge_frag_ctx ctx[BRIDGE_FRAG_CONTEXTS];
+	struct bridge_frag_ctx *done;
+
+	/* counters */
+	u64 tx_fragmented;
+	u64 rx_reassembled;
+	u64 rx_timeouts;
+	u64 rx_errors;
+};
+
+/**
+ * @brief Allocate the reassembly buffers
+ * @param f Fragmentation state
+ * @param dev Device owning the buffers
+ * @param max_len Largest message accepted in either direction
+ * @param timeout_ms Time allowed between the first and last fragment
+ * @return 0 or error
+ */
+static inline int bridge_frag_init(struct bridge_frag *f, struct device *dev, u32 max_len,
+				   unsigned int timeout_ms)
+{
+	int i;
+
+	atomic_set(&f->tx_id, 0);
+	f->max_len = max_len;
+	f->timeout = msecs_to_jiffies(timeout_ms);
+
+	for (i = 0; i < BRIDGE_FRAG_CONTEXTS; i++) {
+		f->ctx[i].buf = devm_kmalloc(dev, max_len, GFP_KERNEL);
+		if (!f->ctx[i].buf) {
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static inline int bridge_frag_count(int len, int mtu)
+{
+	int room = mtu - (int)sizeof(struct bridge_frag_hdr);
+
+	return max(DIV_ROUND_UP(len, room), 1);
+}
+
+static inline u16 bridge_frag_next_id(struct bridge_frag *f)
+{
+	return atomic_inc_return(&f->tx_id);
+}
+
+/**
+ * @brief Build one fragment of a message
+ * @param buf Mtu sized buffer for the fragment
+ * @param mtu Mtu of the endpoint
+ * @param msg_id Id shared by all the fragments of the message
+ * @param data Message
+ * @param len Size of the message
+ * @param index Fragment to build
+ * @return Size of the fragment
+ */
+static inline int bridge_frag_build(void *buf, int mtu, u16 msg_id, void *data, int len,
+				    int index)
+{
+	struct bridge_frag_hdr *hdr = buf;
+	int room = mtu - (int)sizeof(*hdr);
+	int chunk = min(len - index * room, room);
+
+	hdr->msg_id = cpu_to_le16(msg_id);
+	hdr->index = cpu_to_le16(index);
+	hdr->count = cpu_to_le16(bridge_frag_count(len, mtu));
+	hdr->reserved = 0;
+	hdr->total_len = cpu_to_le32(len);
+	memcpy(hdr + 1, (u8 *)data + index * room, chunk);
+
+	return sizeof(*hdr) + chunk;
+}
+
+/**
+ * @brief Check that a message can be fragmented for an endpoint
+ * @param f Fragmentation state
+ * @param len Size of the message
+ * @param mtu Mtu of the endpoint
+ * @return 0 or -EMSGSIZE
+ */
+static inline int bridge_frag_check(struct bridge_frag *f, int len, int mtu)
+{
+	if (len > f->max_len || mtu <= (int)sizeof(struct bridge_frag_hdr) ||
+	    bridge_frag_count(len, mtu) > U16_MAX) {
+		return -EMSGSIZE;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Send a message, split in as many fragments as needed
+ * @param f Fragmentation state
+ * @param ept Endpoint to send on
+ * @param dst Remote address
+ * @param data Message
+ * @param len Size of the message
+ * @param nowait Fail with -ENOMEM instead of waiting for a tx buffer
+ * @return 0 or error
+ */
+static inline int bridge_frag_send(struct bridge_frag *f, struct rpmsg_endpoint *ept, u32 dst,
+				   void *data, int len, bool nowait)
+{
+	int mtu = rpmsg_get_mtu(ept);
+	int count, size, i;
+	u16 msg_id;
+	int ret;
+	u8 *buf;
+
+	ret = bridge_frag_check(f, len, mtu);
+	if (ret) {
+		return ret;
+	}
+
+	buf = kmalloc(mtu, GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	msg_id = bridge_frag_next_id(f);
+	count = bridge_frag_count(len, mtu);
+	for (i = 0; i < count; i++) {
+		size = bridge_frag_build(buf, mtu, msg_id, data, len, i);
+		if (nowait) {
+			ret = rpmsg_trysendto(ept, buf, size, dst);
+		} else {
+			ret = rpmsg_sendto(ept, buf, size, dst);
+		}
+		if (ret) {
+			break;
+		}
+	}
+
+	if (count > 1) {
+		f->tx_fragmented++;
+	}
+
+	kfree(buf);
+
+	return ret;
+}
+
+static inline void bridge_frag_expire(struct bridge_frag *f)
+{
+	int i;
+
+	for (i = 0; i < BRIDGE_FRAG_CONTEXTS; i++) {
+		if (f->ctx[i].busy && time_after(jiffies, f->ctx[i].deadline)) {
+			f->ctx[i].busy = false;
+			f->rx_timeouts++;
+		}
+	}
+}
+
+/**
+ * @brief Feed a received fragment
+ * @param f Fragmentation state
+ * @param data In: the fragment. Out: the complete message
+ * @param len In: size of the fragment. Out: size of the message
+ * @return 0 when a message is complete, -EINPROGRESS while more fragments
+ * are expected, or error
+ *
+ * The returned message stays valid until the next call.
+ */
+static inline int bridge_frag_rx(struct bridge_frag *f, void **data, int *len)
+{
+	struct bridge_frag_hdr *hdr = *data;
+	struct bridge_frag_ctx *ctx = NULL;
+	u16 msg_id, index, count;
+	u32 total_len;
+	int chunk = *len - (int)sizeof(*hdr);
+	int i;
+
+	if (f->done) {
+		f->done->busy = false;
+		f->done = NULL;
+	}
+	bridge_frag_expire(f);
+
+	if (chunk < 0) {
+		f->rx_errors++;
+		return -EBADMSG;
+	}
+
+	msg_id = le16_to_cpu(hdr->msg_id);
+	index = le16_to_cpu(hdr->index);
+	count = le16_to_cpu(hdr->count);
+	total_len = le32_to_cpu(hdr->total_len);
+
+	if (!count || index >= count || total_len > f->max_len) {
+		f->rx_errors++;
+		return -EBADMSG;
+	}
+
+	// single fragment, no copy
+	if (count == 1) {
+		if (chunk != total_len) {
+			f->rx_errors++;
+			return -EBADMSG;
+		}
+		*data = hdr + 1;
+		*len = chunk;
+		return 0;
+	}
+
+	for (i = 0; i < BRIDGE_FRAG_CONTEXTS; i++) {
+		if (index == 0 ? !f->ctx[i].busy : (f->ctx[i].busy && f->ctx[i].msg_id == msg_id)) {
+			ctx = &f->ctx[i];
+			break;
+		}
+	}
+
+	if (!ctx) {
+		// no free context, or the start of the message was lost
+		f->rx_errors++;
+		return -ENOBUFS;
+	}
+
+	if (index == 0) {
+		ctx->busy = true;
+		ctx->msg_id = msg_id;
+		ctx->next = 0;
+		ctx->count = count;
+		ctx->total_len = total_len;
+		ctx->len = 0;
+		ctx->deadline = jiffies + f->timeout;
+	}
+
+	if (index != ctx->next || count != ctx->count || ctx->len + chunk > ctx->total_len) {
+		ctx->busy = false;
+		f->rx_errors++;
+		return -EBADMSG;
+	}
+
+	memcpy(ctx->buf + ctx->len, hdr + 1, chunk);
+	ctx->len += chunk;
+	ctx->next++;
+
+	if (ctx->next < ctx->count) {
+		return -EINPROGRESS;
+	}
+
+	if (ctx->len != ctx->total_len) {
+		ctx->busy = false;
+		f->rx_errors++;
+		return -EBADMSG;
+	}
+
+	f->done = ctx;
+	f->rx_reassembled++;
+	*data = ctx->buf;
+	*len = ctx->len;
+
+	return 0;
+}
+
+static inline void bridge_frag_show(struct seq_file *s, struct bridge_frag *f)
+{
+	seq_printf(s, "tx_fragmented:  %llu\n", f->tx_fragmented);
+	seq_printf(s, "rx_reassembled: %llu\n", f->rx_reassembled);
+	seq_printf(s, "rx_timeouts:    %llu\n", f->rx_timeouts);
+	seq_printf(s, "rx_errors:      %llu\n", f->rx_errors);
+}
+
+#endif /* _BRIDGE_FRAG_H */
@@ -0,0 +1,300 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Generic netlink interface of the rpmsg bridges
+ *
+ * Every bridge module registers its own family, named after the module, so
+ * modules load side by side. Userspace resolves the family id by name. All
+ * families share the commands and attributes below, and the kernel checks
+ * every request against the attribute policy before it reaches the remote.
+ *
+ * BRIDGE_CMD_SEND forwards BRIDGE_ATTR_DATA to the remote through channel
+ * BRIDGE_ATTR_CHANNEL, 0 when missing. The sender becomes the receiver of
+ * the messages of the channel, unless it passes BRIDGE_F_NO_REPLY. With
+ * BRIDGE_F_FLUSH the message, and those held for tx coalescing before it,
+ * go out without waiting for the coalescing timer.
+ * BRIDGE_CMD_SUBSCRIBE makes the caller the receiver without sending
+ * anything, or stops it with BRIDGE_F_UNSUBSCRIBE. Messages from the remote
+ * arrive as BRIDGE_CMD_RECV, with the channel and the data. BRIDGE_CMD_STATS
+ * is answered with the counters of a channel, nested in BRIDGE_ATTR_STATS.
+ *
+ * BRIDGE_CMD_SUBSCRIBE can carry a filter for the receiver (bridge_filter.h):
+ * BRIDGE_ATTR_FILTER_PREFIX with BRIDGE_ATTR_FILTER_OFFSET, or a classic BPF
+ * program in BRIDGE_ATTR_FILTER_BPF, an array of struct sock_filter. Messages
+ * the filter drops never get an skb. A subscription without a filter, or a
+ * new sender through BRIDGE_CMD_SEND, gets every message again.
+ *
+ * Every message from the remote is also multicast to the "rx" group, one
+ * skb for all its members, so any number of monitors can follow the
+ * channels next to the receiver. Joining the group is enough, no request
+ * has to be sent first. The members share the skb, they filter it in their
+ * own socket with SO_ATTACH_FILTER, the filter of BRIDGE_CMD_SUBSCRIBE only
+ * applies to the receiver. Channels coming and going are announced to the
+ * "events" group with BRIDGE_CMD_CHANNEL_NEW and BRIDGE_CMD_CHANNEL_DEL.
+ *
+ * This header is also meant to be included from userspace.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_GENL_H
+#define _BRIDGE_GENL_H
+
+#include <linux/types.h>
+
+#define BRIDGE_GENL_VERSION 1
+
+#define BRIDGE_GENL_MCGRP_EVENTS "events"
+#define BRIDGE_GENL_MCGRP_RX     "rx"
+
+enum bridge_cmd {
+	BRIDGE_CMD_UNSPEC,
+	BRIDGE_CMD_SEND,        /* CHANNEL, DATA, FLAGS */
+	BRIDGE_CMD_RECV,        /* to userspace: CHANNEL, DATA */
+	BRIDGE_CMD_STATS,       /* CHANNEL, answered with CHANNEL and STATS */
+	BRIDGE_CMD_SUBSCRIBE,   /* CHANNEL, FLAGS */
+	BRIDGE_CMD_CHANNEL_NEW, /* events group: CHANNEL */
+	BRIDGE_CMD_CHANNEL_DEL, /* events group: CHANNEL */
+	__BRIDGE_CMD_MAX,
+};
+#define BRIDGE_CMD_MAX (__BRIDGE_CMD_MAX - 1)
+
+enum bridge_attr {
+	BRIDGE_ATTR_UNSPEC,
+	BRIDGE_ATTR_CHANNEL, /* u32 */
+	BRIDGE_ATTR_DATA,    /* binary */
+	BRIDGE_ATTR_FLAGS,   /* u32, BRIDGE_F_* */
+	BRIDGE_ATTR_STATS,   /* nested, BRIDGE_STAT_* */
+	BRIDGE_ATTR_PAD,
+	BRIDGE_ATTR_FILTER_OFFSET, /* u16, offset of FILTER_PREFIX in the message */
+	BRIDGE_ATTR_FILTER_PREFIX, /* binary, up to BRIDGE_FILTER_PREFIX_MAX bytes */
+	BRIDGE_ATTR_FILTER_BPF,    /* binary, struct sock_filter[] */
+	__BRIDGE_ATTR_MAX,
+};
+#define BRIDGE_ATTR_MAX (__BRIDGE_ATTR_MAX - 1)
+
+#define BRIDGE_F_NO_REPLY    0x1 /* SEND: the sender does not want the answer */
+#define BRIDGE_F_UNSUBSCRIBE 0x2 /* SUBSCRIBE: stop receiving the channel */
+#define BRIDGE_F_FLUSH       0x4 /* SEND: do not hold the message for tx coalescing */
+#define BRIDGE_F_ALL         (BRIDGE_F_NO_REPLY | BRIDGE_F_UNSUBSCRIBE | BRIDGE_F_FLUSH)
+
+enum bridge_stat {
+	BRIDGE_STAT_UNSPEC,
+	BRIDGE_STAT_PAD,
+	BRIDGE_STAT_RX_QUEUED,    /* u64, messages from the remote */
+	BRIDGE_STAT_RX_OVERFLOWS, /* u64, dropped in the rpmsg callback */
+	BRIDGE_STAT_TX_QUEUED,    /* u64, messages queued for the remote */
+	BRIDGE_STAT_TX_SENT,      /* u64 */
+	BRIDGE_STAT_TX_FULL,      /* u64, sends refused with -EAGAIN */
+	BRIDGE_STAT_TX_ERRORS,    /* u64 */
+	BRIDGE_STAT_TX_STALL_US,  /* u64, time waiting for a free rpmsg buffer */
+	BRIDGE_STAT_RD_QUEUED,    /* u64, messages in the char device log */
+	BRIDGE_STAT_RD_LOST,      /* u64, evicted before any reader got them */
+	BRIDGE_STAT_RD_FILTERED,  /* u64, wakeups saved by char device filters */
+	BRIDGE_STAT_NL_FILTERED,  /* u64, dropped by the filter of the receiver */
+	BRIDGE_STAT_CREDIT_STALL_US, /* u64, time the remote had no credit left */
+	BRIDGE_STAT_TX_PACKED,    /* u64, rpmsg buffers carrying coalesced messages */
+	BRIDGE_STAT_CREDIT_DROPS, /* u64, messages a consumer could not take */
+	__BRIDGE_STAT_MAX,
+};
+#define BRIDGE_STAT_MAX (__BRIDGE_STAT_MAX - 1)
+
+#ifdef __KERNEL__
+
+#include <net/genetlink.h>
+
+#include "bridge_chan.h"
+#include "bridge_rx.h"
+#include "bridge_tx.h"
+#include "bridge_msgq.h"
+#include "bridge_filter.h"
+#include "bridge_credit.h"
+
+enum bridge_genl_group {
+	BRIDGE_GENL_GRP_EVENTS,
+	BRIDGE_GENL_GRP_RX,
+};
+
+static const struct genl_multicast_group bridge_genl_mcgrps[] = {
+	[BRIDGE_GENL_GRP_EVENTS] = {.name = BRIDGE_GENL_MCGRP_EVENTS},
+	[BRIDGE_GENL_GRP_RX] = {.name = BRIDGE_GENL_MCGRP_RX},
+};
+
+static const struct nla_policy bridge_genl_policy[BRIDGE_ATTR_MAX + 1] = {
+	[BRIDGE_ATTR_CHANNEL] = NLA_POLICY_MAX(NLA_U32, BRIDGE_MAX_CHANNELS - 1),
+	[BRIDGE_ATTR_DATA] = {.type = NLA_BINARY},
+	[BRIDGE_ATTR_FLAGS] = {.type = NLA_U32},
+	[BRIDGE_ATTR_FILTER_OFFSET] = {.type = NLA_U16},
+	[BRIDGE_ATTR_FILTER_PREFIX] = {.type = NLA_BINARY, .len = BRIDGE_FILTER_PREFIX_MAX},
+	[BRIDGE_ATTR_FILTER_BPF] = {.type = NLA_BINARY,
+				    .len = BPF_MAXINSNS * sizeof(struct sock_filter)},
+};
+
+/**
+ * @brief Read the channel and flags of a request
+ * @param info Request
+ * @param flags BRIDGE_ATTR_FLAGS, 0 when missing
+ * @return Channel id or -EINVAL for unknown flags
+ */
+static inline int bridge_genl_parse(struct genl_info *info, u32 *flags)
+{
+	*flags = 0;
+	if (info->attrs[BRIDGE_ATTR_FLAGS]) {
+		*flags = nla_get_u32(info->attrs[BRIDGE_ATTR_FLAGS]);
+	}
+	if (*flags & ~BRIDGE_F_ALL) {
+		NL_SET_ERR_MSG_ATTR(info->extack, info->attrs[BRIDGE_ATTR_FLAGS], "unknown flags");
+		return -EINVAL;
+	}
+
+	if (!info->attrs[BRIDGE_ATTR_CHANNEL]) {
+		return 0;
+	}
+
+	return nla_get_u32(info->attrs[BRIDGE_ATTR_CHANNEL]);
+}
+
+/**
+ * @brief Build the filter of a BRIDGE_CMD_SUBSCRIBE request
+ * @param info Request
+ * @return Filter, NULL when the request has none, or ERR_PTR()
+ */
+static inline struct bridge_filter *bridge_genl_filter(struct genl_info *info)
+{
+	struct nlattr *bpf = info->attrs[BRIDGE_ATTR_FILTER_BPF];
+	struct nlattr *prefix = info->attrs[BRIDGE_ATTR_FILTER_PREFIX];
+	u16 offset = 0;
+
+	if (bpf && prefix) {
+		NL_SET_ERR_MSG(info->extack, "prefix and BPF filters are exclusive");
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (bpf) {
+		if (nla_len(bpf) % sizeof(struct sock_filter)) {
+			NL_SET_ERR_MSG_ATTR(info->extack, bpf, "not a struct sock_filter array");
+			return ERR_PTR(-EINVAL);
+		}
+		return bridge_filter_bpf(nla_data(bpf), nla_len(bpf) / sizeof(struct sock_filter));
+	}
+
+	if (prefix) {
+		if (info->attrs[BRIDGE_ATTR_FILTER_OFFSET]) {
+			offset = nla_get_u16(info->attrs[BRIDGE_ATTR_FILTER_OFFSET]);
+		}
+		return bridge_filter_prefix(offset, nla_data(prefix), nla_len(prefix));
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Payload of a BRIDGE_CMD_RECV message
+ * @param len Size of the data
+ * @return Size to pass to nlmsg_new()
+ */
+static inline int bridge_genl_msg_size(int len)
+{
+	return GENL_HDRLEN + nla_total_size(sizeof(u32)) + nla_total_size(len);
+}
+
+/**
+ * @brief Append a BRIDGE_CMD_RECV message to an skb
+ * @param skb Socket buffer
+ * @param family Family of the module
+ * @param seq nlmsg_seq of the request this message answers, or 0
+ * @param flags Netlink flags, NLM_F_MULTI when coalescing
+ * @param id Channel of the message
+ * @param data Message
+ * @param len Size of the message
+ * @return 0 or -EMSGSIZE
+ */
+static inline int bridge_genl_put_msg(struct sk_buff *skb, struct genl_family *family, u32 seq,
+				      int flags, int id, void *data, int len)
+{
+	void *hdr;
+
+	hdr = genlmsg_put(skb, 0, seq, family, flags, BRIDGE_CMD_RECV);
+	if (!hdr) {
+		return -EMSGSIZE;
+	}
+
+	if (nla_put_u32(skb, BRIDGE_ATTR_CHANNEL, id) ||
+	    nla_put(skb, BRIDGE_ATTR_DATA, len, data)) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
+	}
+	genlmsg_end(skb, hdr);
+
+	return 0;
+}
+
+/**
+ * @brief Announce a channel to the events group
+ * @param family Family of the module
+ * @param cmd BRIDGE_CMD_CHANNEL_NEW or BRIDGE_CMD_CHANNEL_DEL
+ * @param id Channel
+ */
+static inline void bridge_genl_notify(struct genl_family *family, u8 cmd, int id)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = genlmsg_new(nla_total_size(sizeof(u32)), GFP_KERNEL);
+	if (!skb) {
+		return;
+	}
+
+	hdr = genlmsg_put(skb, 0, 0, family, 0, cmd);
+	if (!hdr || nla_put_u32(skb, BRIDGE_ATTR_CHANNEL, id)) {
+		nlmsg_free(skb);
+		return;
+	}
+	genlmsg_end(skb, hdr);
+
+	// nobody listening is not an error
+	genlmsg_multicast(family, skb, 0, BRIDGE_GENL_GRP_EVENTS, GFP_KERNEL);
+}
+
+static inline bool bridge_genl_has_subscribers(struct genl_family *family)
+{
+	return genl_has_listeners(family, &init_net, BRIDGE_GENL_GRP_RX);
+}
+
+static inline int bridge_genl_put_stat(struct sk_buff *skb, int type, u64 value)
+{
+	return nla_put_u64_64bit(skb, type, value, BRIDGE_STAT_PAD);
+}
+
+static inline int bridge_genl_put_rx(struct sk_buff *skb, struct bridge_rx *rx)
+{
+	return bridge_genl_put_stat(skb, BRIDGE_STAT_RX_QUEUED, rx->queued) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_RX_OVERFLOWS, rx->overflows);
+}
+
+static inline int bridge_genl_put_tx(struct sk_buff *skb, struct bridge_tx *tx)
+{
+	return bridge_genl_put_stat(skb, BRIDGE_STAT_TX_QUEUED, tx->queued) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_TX_SENT, tx->sent) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_TX_FULL, tx->full) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_TX_ERRORS, tx->errors) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_TX_PACKED, tx->packed) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_TX_STALL_US,
+				    div_u64(tx->stall_ns, NSEC_PER_USEC));
+}
+
+static inline int bridge_genl_put_msgq(struct sk_buff *skb, struct bridge_msgq *q)
+{
+	return bridge_genl_put_stat(skb, BRIDGE_STAT_RD_QUEUED, q->queued) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_RD_LOST, q->lost) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_RD_FILTERED, q->filtered);
+}
+
+static inline int bridge_genl_put_credit(struct sk_buff *skb, struct bridge_credit *c)
+{
+	return bridge_genl_put_stat(skb, BRIDGE_STAT_CREDIT_STALL_US, bridge_credit_stall_us(c)) ||
+	       bridge_genl_put_stat(skb, BRIDGE_STAT_CREDIT_DROPS, c->drops);
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* _BRIDGE_GENL_H */
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * ioctl interface of the bridge character devices
+ *
+ * BRIDGE_IOC_SUBMIT_BATCH and BRIDGE_IOC_RECV_BATCH move several messages
+ * per call, like sendmmsg()/recvmmsg(). Both return the number of messages
+ * processed; an error is only returned when the first one fails.
+ *
+ * A message is taken from the queue before it is copied out. Entries and
+ * their buffers are checked first, but a buffer that still faults during
+ * the copy, an unmapped page for instance, loses its message: the call
+ * ends there and the message is not read again. The same holds for read()
+ * and readv(), which also keep only the part of a message that fits its
+ * iovec.
+ *
+ * BRIDGE_IOC_CREATE_EPT, issued on the node of a channel, creates another
+ * rpmsg endpoint on it with its own address, queue and node, DEVICE_NAME<id>.
+ * The endpoint is also reachable over netlink as channel id. It lives until
+ * BRIDGE_IOC_DESTROY_EPT is issued on its own node or the channel goes away.
+ *
+ * BRIDGE_IOC_SET_FILTER sets the filter of an open file: read() and poll()
+ * only see the messages it accepts, and the file is not woken up for the
+ * others. See bridge_filter.h. The mmap'able ring is not filtered.
+ *
+ * BRIDGE_IOC_FLUSH sends the messages held by the tx coalescer of the
+ * channel right away instead of waiting for its timer, see bridge_tx.h.
+ *
+ * This header is also meant to be included from userspace.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_IOCTL_H
+#define _BRIDGE_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define BRIDGE_BATCH_MAX 1024 /* messages per batch call */
+
+#define BRIDGE_MSG_TRUNC 0x1 /* message was longer than buf, the rest is lost */
+
+struct bridge_msg {
+	__u64 buf;   /* user pointer */
+	__u32 len;   /* in: size of buf, out (recv): bytes stored in buf */
+	__u32 flags; /* out (recv): BRIDGE_MSG_* */
+};
+
+struct bridge_batch {
+	__u64 msgs;  /* user pointer to an array of struct bridge_msg */
+	__u32 count; /* entries in msgs, at most BRIDGE_BATCH_MAX */
+	__u32 flags; /* must be 0 */
+};
+
+#define BRIDGE_ADDR_ANY 0xFFFFFFFF
+
+struct bridge_ept_info {
+	char name[32]; /* endpoint name, NUL terminated */
+	__u32 src;     /* in: local address or BRIDGE_ADDR_ANY, out: address bound */
+	__u32 dst;     /* remote address, BRIDGE_ADDR_ANY for the one of the channel */
+	__u32 id;      /* out: channel id of the endpoint */
+	__u32 reserved;
+};
+
+#define BRIDGE_FILTER_NONE   0 /* every message */
+#define BRIDGE_FILTER_PREFIX 1 /* messages with prefix at offset */
+#define BRIDGE_FILTER_BPF    2 /* messages a classic BPF program accepts */
+
+#define BRIDGE_FILTER_PREFIX_MAX 16
+
+struct bridge_filter_info {
+	__u32 kind;   /* BRIDGE_FILTER_* */
+	__u16 offset; /* PREFIX: offset of the prefix in the message */
+	__u16 len;    /* PREFIX: bytes in prefix, BPF: instructions in insns */
+	__u8 prefix[BRIDGE_FILTER_PREFIX_MAX];
+	__u64 insns; /* BPF: user pointer to an array of struct sock_filter */
+};
+
+#define BRIDGE_IOC_MAGIC        'b'
+#define BRIDGE_IOC_SET_EVENTFD  _IOW(BRIDGE_IOC_MAGIC, 1, int)
+#define BRIDGE_IOC_SUBMIT_BATCH _IOW(BRIDGE_IOC_MAGIC, 2, struct bridge_batch)
+#define BRIDGE_IOC_RECV_BATCH   _IOW(BRIDGE_IOC_MAGIC, 3, struct bridge_batch)
+#define BRIDGE_IOC_CREATE_EPT   _IOWR(BRIDGE_IOC_MAGIC, 4, struct bridge_ept_info)
+#define BRIDGE_IOC_DESTROY_EPT  _IO(BRIDGE_IOC_MAGIC, 5)
+#define BRIDGE_IOC_SET_FILTER   _IOW(BRIDGE_IOC_MAGIC, 6, struct bridge_filter_info)
+#define BRIDGE_IOC_FLUSH        _IO(BRIDGE_IOC_MAGIC, 7)
+
+#endif /* _BRIDGE_IOCTL_H */
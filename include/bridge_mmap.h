@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Shared memory rx ring of the bridge character devices
+ *
+ * The first page of the mapping holds struct bridge_ring_ctrl, the slots
+ * follow at data_offset. The kernel fills the slot at head and advances it,
+ * userspace consumes the slot at tail and advances it. No message is
+ * overwritten before userspace consumed it, when the ring is full new
+ * messages are dropped and counted.
+ *
+ * The ring is not flow controlled. The kernel does not see tail move, so
+ * with credits on (bridge_credit.h) a message counts as taken as soon as it
+ * is in the ring, and one that does not fit gives its credit back as a
+ * drop. A reader that needs the remote throttled uses read() instead.
+ *
+ * To sleep only when the ring is empty, userspace stores tail, issues a
+ * full barrier and checks head again before waiting in poll() or on the
+ * eventfd registered with BRIDGE_IOC_SET_EVENTFD. The eventfd is signalled
+ * when a message lands in an empty ring.
+ *
+ * This header is also meant to be included from userspace.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_MMAP_H
+#define _BRIDGE_MMAP_H
+
+#include <linux/types.h>
+
+#include "bridge_ioctl.h"
+
+#define BRIDGE_RING_MAGIC   0x52474442 /* "BDGR" */
+#define BRIDGE_RING_VERSION 1
+
+struct bridge_ring_ctrl {
+	__u32 magic;
+	__u32 version;
+	__u32 nslots;      /* power of two */
+	__u32 slot_size;   /* bytes per slot, header included */
+	__u32 data_offset; /* offset of slot 0 in the mapping */
+	__u32 head;        /* written by the kernel */
+	__u32 dropped;     /* written by the kernel */
+	__u32 reserved[9];
+	__u32 tail; /* written by userspace, on its own cache line */
+};
+
+struct bridge_ring_slot {
+	__u32 len;
+	__u32 reserved;
+	__u8 data[];
+};
+
+#ifdef __KERNEL__
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+
+struct bridge_mmap {
+	struct bridge_ring_ctrl *ctrl;
+	u8 *slots;
+	size_t size;
+	unsigned int nslots;
+	unsigned int slot_size;
+	atomic_t mapped;
+	wait_queue_head_t wait;
+
+	spinlock_t efd_lock; /* protects efd */
+	struct eventfd_ctx *efd;
+
+	/* counters */
+	u64 pushed;
+	u64 too_big;
+	u64 wakeups;
+};
+
+/**
+ * @brief Allocate the ring
+ * @param r Ring
+ * @param nslots Number of slots, rounded up to a power of two
+ * @param slot_size Largest message, the slot header is added on top
+ * @return 0 or error
+ */
+static inline int bridge_mmap_init(struct bridge_mmap *r, unsigned int nslots,
+				   unsigned int slot_size)
+{
+	r->nslots = roundup_pow_of_two(max(nslots, 2U));
+	r->slot_size = ALIGN(sizeof(struct bridge_ring_slot) + slot_size, 8);
+	r->size = PAGE_ALIGN(PAGE_SIZE + (size_t)r->nslots * r->slot_size);
+
+	r->ctrl = vmalloc_user(r->size);
+	if (!r->ctrl) {
+		return -ENOMEM;
+	}
+	r->slots = (u8 *)r->ctrl + PAGE_SIZE;
+
+	r->ctrl->magic = BRIDGE_RING_MAGIC;
+	r->ctrl->version = BRIDGE_RING_VERSION;
+	r->ctrl->nslots = r->nslots;
+	r->ctrl->slot_size = r->slot_size;
+	r->ctrl->data_offset = PAGE_SIZE;
+
+	atomic_set(&r->mapped, 0);
+	init_waitqueue_head(&r->wait);
+	spin_lock_init(&r->efd_lock);
+
+	return 0;
+}
+
+static inline void bridge_mmap_free(struct bridge_mmap *r)
+{
+	if (r->efd) {
+		eventfd_ctx_put(r->efd);
+	}
+	vfree(r->ctrl);
+	r->ctrl = NULL;
+}
+
+static inline bool bridge_mmap_mapped(struct bridge_mmap *r)
+{
+	return r->ctrl && atomic_read(&r->mapped);
+}
+
+static inline bool bridge_mmap_empty(struct bridge_mmap *r)
+{
+	return READ_ONCE(r->ctrl->head) == READ_ONCE(r->ctrl->tail);
+}
+
+/**
+ * @brief Write a message in the ring
+ * @param r Ring
+ * @param data Message
+ * @param len Size of the message
+ * @return 0, -ENOSPC if userspace is behind, or -EMSGSIZE
+ *
+ * Single producer, the rx worker.
+ */
+static inline int bridge_mmap_push(struct bridge_mmap *r, void *data, int len)
+{
+	struct bridge_ring_slot *slot;
+	unsigned long flags;
+	u32 head = r->ctrl->head;
+	u32 tail = READ_ONCE(r->ctrl->tail);
+
+	if (len > r->slot_size - sizeof(*slot)) {
+		r->too_big++;
+		WRITE_ONCE(r->ctrl->dropped, r->ctrl->dropped + 1);
+		return -EMSGSIZE;
+	}
+
+	// tail comes from userspace, anything out of range counts as full
+	if (head - tail >= r->nslots) {
+		WRITE_ONCE(r->ctrl->dropped, r->ctrl->dropped + 1);
+		return -ENOSPC;
+	}
+
+	slot = (struct bridge_ring_slot *)(r->slots + (head & (r->nslots - 1)) * r->slot_size);
+	slot->len = len;
+	memcpy(slot->data, data, len);
+	smp_store_release(&r->ctrl->head, head + 1);
+	r->pushed++;
+
+	// pairs with the barrier between the tail store and head load in userspace
+	smp_mb();
+	if (READ_ONCE(r->ctrl->tail) == head) {
+		r->wakeups++;
+		spin_lock_irqsave(&r->efd_lock, flags);
+		if (r->efd) {
+			eventfd_signal(r->efd, 1);
+		}
+		spin_unlock_irqrestore(&r->efd_lock, flags);
+		wake_up_interruptible_poll(&r->wait, EPOLLIN | EPOLLRDNORM);
+	}
+
+	return 0;
+}
+
+static void bridge_mmap_vm_open(struct vm_area_struct *vma)
+{
+	struct bridge_mmap *r = vma->vm_private_data;
+
+	atomic_inc(&r->mapped);
+}
+
+static void bridge_mmap_vm_close(struct vm_area_struct *vma)
+{
+	struct bridge_mmap *r = vma->vm_private_data;
+
+	atomic_dec(&r->mapped);
+}
+
+static const struct vm_operations_struct bridge_mmap_vm_ops = {
+	.open = bridge_mmap_vm_open,
+	.close = bridge_mmap_vm_close,
+};
+
+/**
+ * @brief Map the whole ring, control page included
+ * @param r Ring
+ * @param vma Mapping requested by userspace
+ * @return 0 or error
+ */
+static inline int bridge_mmap_mmap(struct bridge_mmap *r, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (!r->ctrl) {
+		return -ENODEV;
+	}
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != r->size) {
+		return -EINVAL;
+	}
+
+	ret = remap_vmalloc_range(vma, r->ctrl, 0);
+	if (ret) {
+		return ret;
+	}
+
+	vma->vm_private_data = r;
+	vma->vm_ops = &bridge_mmap_vm_ops;
+	bridge_mmap_vm_open(vma);
+
+	return 0;
+}
+
+static inline __poll_t bridge_mmap_poll(struct bridge_mmap *r, struct file *filep,
+					poll_table *wait)
+{
+	if (!bridge_mmap_mapped(r)) {
+		return 0;
+	}
+
+	poll_wait(filep, &r->wait, wait);
+
+	return bridge_mmap_empty(r) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+/**
+ * @brief Register the eventfd signalled when the ring stops being empty
+ * @param r Ring
+ * @param fd Eventfd, or -1 to remove it
+ * @return 0 or error
+ */
+static inline int bridge_mmap_set_eventfd(struct bridge_mmap *r, int fd)
+{
+	struct eventfd_ctx *efd = NULL, *old;
+	unsigned long flags;
+
+	if (fd >= 0) {
+		efd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(efd)) {
+			return PTR_ERR(efd);
+		}
+	}
+
+	spin_lock_irqsave(&r->efd_lock, flags);
+	old = r->efd;
+	r->efd = efd;
+	spin_unlock_irqrestore(&r->efd_lock, flags);
+
+	if (old) {
+		eventfd_ctx_put(old);
+	}
+
+	return 0;
+}
+
+static inline void bridge_mmap_show(struct seq_file *s, struct bridge_mmap *r)
+{
+	if (!r->ctrl) {
+		return;
+	}
+
+	seq_printf(s, "mmap_ring:    %u/%u (%d maps)\n",
+		   READ_ONCE(r->ctrl->head) - READ_ONCE(r->ctrl->tail), r->nslots,
+		   atomic_read(&r->mapped));
+	seq_printf(s, "mmap_pushed:  %llu\n", r->pushed);
+	seq_printf(s, "mmap_dropped: %u\n", READ_ONCE(r->ctrl->dropped));
+	seq_printf(s, "mmap_too_big: %llu\n", r->too_big);
+	seq_printf(s, "mmap_wakeups: %llu\n", r->wakeups);
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* _BRIDGE_MMAP_H */
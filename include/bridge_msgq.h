@@ -0,0 +1,342 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Message log behind the bridge character devices
+ *
+ * Messages from the remote are kept whole in a log of the last depth
+ * messages, numbered in arrival order. Every open file is a reader with its
+ * own cursor, so each reader sees every message once, like datagrams, and
+ * several processes can follow the same stream. Messages are reference
+ * counted: readers copy them out without holding the lock and the stream is
+ * never copied per reader.
+ *
+ * A reader that falls more than depth messages behind skips to the oldest
+ * message still in the log. A new reader starts after the last message any
+ * reader got, so a lone reader still gets what arrived while the device was
+ * closed.
+ *
+ * Readers sleep until a message arrives unless the file is O_NONBLOCK, and
+ * poll() reports EPOLLIN while the reader has messages pending. A reader
+ * with a filter (bridge_filter.h) only gets, and is only woken up for, the
+ * messages the filter accepts.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_MSGQ_H
+#define _BRIDGE_MSGQ_H
+
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+
+#include "bridge_filter.h"
+
+struct bridge_msgq_msg {
+	struct kref ref;
+	int len;
+	u8 data[];
+};
+
+struct bridge_msgq {
+	spinlock_t lock; /* protects msgs, count, head, read_seq and reader_list */
+	struct bridge_msgq_msg **msgs; /* message seq is msgs[seq & (depth - 1)] */
+	unsigned int depth;
+	unsigned int count;
+	u64 head;     /* seq of the next message */
+	u64 read_seq; /* furthest any reader got */
+	struct list_head reader_list;
+	atomic_t readers;
+	/* called when read_seq moves on by n messages, may be NULL */
+	void (*consumed)(struct bridge_msgq *q, unsigned int n);
+
+	/* counters */
+	u64 queued;
+	u64 filtered; /* wakeups saved by reader filters */
+	u64 dropped; /* out of memory, never logged */
+	u64 evicted;
+	u64 lost; /* evicted before any reader got them */
+};
+
+struct bridge_msgq_reader {
+	struct bridge_msgq *q;
+	u64 seq;   /* next message to read */
+	u64 match; /* past the last message the filter accepted */
+	struct bridge_filter __rcu *filter;
+	struct list_head node; /* in q->reader_list */
+	wait_queue_head_t wait;
+};
+
+/**
+ * @brief Allocate the log
+ * @param q Log
+ * @param depth Messages kept, rounded up to a power of two
+ * @return 0 or -ENOMEM
+ */
+static inline int bridge_msgq_init(struct bridge_msgq *q, unsigned int depth)
+{
+	spin_lock_init(&q->lock);
+	INIT_LIST_HEAD(&q->reader_list);
+	atomic_set(&q->readers, 0);
+	q->depth = roundup_pow_of_two(max(depth, 1U));
+
+	q->msgs = kcalloc(q->depth, sizeof(*q->msgs), GFP_KERNEL);
+	if (!q->msgs) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static inline void bridge_msgq_msg_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct bridge_msgq_msg, ref));
+}
+
+static inline void bridge_msgq_put(struct bridge_msgq_msg *msg)
+{
+	kref_put(&msg->ref, bridge_msgq_msg_release);
+}
+
+/**
+ * @brief Append a message to the log and wake up the readers that want it
+ * @param q Log
+ * @param data Message
+ * @param len Size of the message
+ * @return 0 or -ENOMEM
+ */
+static inline int bridge_msgq_push(struct bridge_msgq *q, void *data, int len)
+{
+	struct bridge_msgq_msg *msg, *old = NULL;
+	struct bridge_msgq_reader *r;
+	struct bridge_filter *f;
+	unsigned long flags;
+	unsigned int slot;
+
+	msg = kmalloc(sizeof(*msg) + len, GFP_KERNEL);
+	if (!msg) {
+		q->dropped++;
+		return -ENOMEM;
+	}
+	kref_init(&msg->ref);
+	msg->len = len;
+	memcpy(msg->data, data, len);
+
+	spin_lock_irqsave(&q->lock, flags);
+	slot = q->head & (q->depth - 1);
+	if (q->count == q->depth) {
+		// the slot holds the oldest message
+		old = q->msgs[slot];
+		q->evicted++;
+		if (q->read_seq <= q->head - q->depth) {
+			q->lost++;
+		}
+	} else {
+		q->count++;
+	}
+	q->msgs[slot] = msg;
+	q->head++;
+	q->queued++;
+
+	list_for_each_entry(r, &q->reader_list, node) {
+		f = rcu_dereference_protected(r->filter, lockdep_is_held(&q->lock));
+		if (bridge_filter_match(f, data, len)) {
+			WRITE_ONCE(r->match, q->head);
+			wake_up_interruptible_poll(&r->wait, EPOLLIN | EPOLLRDNORM);
+		} else {
+			q->filtered++;
+		}
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	if (old) {
+		// readers still copying it hold their own reference
+		bridge_msgq_put(old);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Start following the log
+ * @param r Reader, usually kept in filp->private_data
+ * @param q Log
+ */
+static inline void bridge_msgq_reader_init(struct bridge_msgq_reader *r, struct bridge_msgq *q)
+{
+	unsigned long flags;
+
+	r->q = q;
+	RCU_INIT_POINTER(r->filter, NULL);
+	init_waitqueue_head(&r->wait);
+	spin_lock_irqsave(&q->lock, flags);
+	r->seq = max(q->read_seq, q->head - q->count);
+	r->match = q->head;
+	list_add_tail(&r->node, &q->reader_list);
+	spin_unlock_irqrestore(&q->lock, flags);
+	atomic_inc(&q->readers);
+}
+
+static inline void bridge_msgq_reader_release(struct bridge_msgq_reader *r)
+{
+	struct bridge_msgq *q = r->q;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	list_del(&r->node);
+	spin_unlock_irqrestore(&q->lock, flags);
+	atomic_dec(&q->readers);
+
+	bridge_filter_free(rcu_dereference_protected(r->filter, true));
+}
+
+/**
+ * @brief Replace the filter of a reader
+ * @param r Reader
+ * @param f Filter, NULL to get every message
+ */
+static inline void bridge_msgq_set_filter(struct bridge_msgq_reader *r, struct bridge_filter *f)
+{
+	struct bridge_msgq *q = r->q;
+	struct bridge_filter *old;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	old = rcu_replace_pointer(r->filter, f, lockdep_is_held(&q->lock));
+	// messages already in the log are checked when they are read
+	r->match = q->head;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	bridge_filter_free(old);
+}
+
+static inline bool bridge_msgq_pending(struct bridge_msgq_reader *r)
+{
+	return READ_ONCE(r->match) > READ_ONCE(r->seq);
+}
+
+/**
+ * @brief Take a reference to the next message of a reader
+ * @param r Reader
+ * @return Message, to be released with bridge_msgq_put(), or NULL
+ *
+ * Messages the filter of the reader does not accept are skipped.
+ */
+static inline struct bridge_msgq_msg *bridge_msgq_pop(struct bridge_msgq_reader *r)
+{
+	struct bridge_msgq *q = r->q;
+	struct bridge_msgq_msg *msg;
+	unsigned long flags;
+	unsigned int n;
+	bool match;
+
+	for (;;) {
+		n = 0;
+		spin_lock_irqsave(&q->lock, flags);
+		if (r->seq < q->head - q->count) {
+			// fell behind, the gap was already evicted
+			r->seq = q->head - q->count;
+		}
+		if (r->seq == q->head) {
+			spin_unlock_irqrestore(&q->lock, flags);
+			return NULL;
+		}
+		msg = q->msgs[r->seq & (q->depth - 1)];
+		kref_get(&msg->ref);
+		r->seq++;
+		if (r->seq > q->read_seq) {
+			n = r->seq - q->read_seq;
+			q->read_seq = r->seq;
+		}
+		spin_unlock_irqrestore(&q->lock, flags);
+
+		if (n && q->consumed) {
+			q->consumed(q, n);
+		}
+
+		rcu_read_lock();
+		match = bridge_filter_match(rcu_dereference(r->filter), msg->data, msg->len);
+		rcu_read_unlock();
+		if (match) {
+			return msg;
+		}
+		bridge_msgq_put(msg);
+	}
+}
+
+/**
+ * @brief Take the next message, waiting for one if there is none
+ * @param r Reader
+ * @param nonblock Return -EAGAIN instead of waiting for a message
+ * @return Message, to be released with bridge_msgq_put(), or ERR_PTR()
+ */
+static inline struct bridge_msgq_msg *bridge_msgq_wait_pop(struct bridge_msgq_reader *r,
+							   bool nonblock)
+{
+	struct bridge_msgq_msg *msg;
+	int ret;
+
+	for (;;) {
+		msg = bridge_msgq_pop(r);
+		if (msg) {
+			return msg;
+		}
+		if (nonblock) {
+			return ERR_PTR(-EAGAIN);
+		}
+		ret = wait_event_interruptible(r->wait, bridge_msgq_pending(r));
+		if (ret) {
+			return ERR_PTR(ret);
+		}
+	}
+}
+
+static inline __poll_t bridge_msgq_poll(struct bridge_msgq_reader *r, struct file *filep,
+					poll_table *wait)
+{
+	poll_wait(filep, &r->wait, wait);
+
+	return bridge_msgq_pending(r) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/**
+ * @brief Drop every message and free the log
+ * @param q Log, without readers
+ */
+static inline void bridge_msgq_destroy(struct bridge_msgq *q)
+{
+	unsigned int i;
+
+	if (!q->msgs) {
+		return;
+	}
+
+	for (i = 0; i < q->depth; i++) {
+		if (q->msgs[i]) {
+			bridge_msgq_put(q->msgs[i]);
+		}
+	}
+	kfree(q->msgs);
+	q->msgs = NULL;
+	q->count = 0;
+}
+
+static inline void bridge_msgq_show(struct seq_file *s, struct bridge_msgq *q)
+{
+	seq_printf(s, "rd_log:       %u/%u (%d readers)\n", READ_ONCE(q->count), q->depth,
+		   atomic_read(&q->readers));
+	seq_printf(s, "rd_queued:    %llu\n", q->queued);
+	seq_printf(s, "rd_filtered:  %llu\n", q->filtered);
+	seq_printf(s, "rd_dropped:   %llu\n", q->dropped);
+	seq_printf(s, "rd_evicted:   %llu\n", q->evicted);
+	seq_printf(s, "rd_lost:      %llu\n", q->lost);
+}
+
+#endif /* _BRIDGE_MSGQ_H */
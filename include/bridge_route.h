@@ -0,0 +1,254 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Reply routing of the netlink bridge
+ *
+ * Every request forwarded to the remote starts with a struct bridge_route_hdr
+ * holding a sequence number, and the remote starts its reply with the same
+ * header. The kernel keeps the netlink port and nlmsg_seq of every request
+ * in flight, keyed by sequence number, so each reply goes back to the
+ * process that sent the request with the nlmsg_seq it used. Concurrent
+ * clients can keep several requests in flight each.
+ *
+ * A message from the remote with sequence 0, or with a sequence not in
+ * flight, is not a reply and goes to the last client. Requests the remote
+ * never answers expire after a timeout, and when the table is full the
+ * oldest one is dropped.
+ *
+ * With the wire header of bridge_wire.h on, the sequence number travels in
+ * it and there is no struct bridge_route_hdr.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_ROUTE_H
+#define _BRIDGE_ROUTE_H
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+#include <linux/seq_file.h>
+
+#define BRIDGE_ROUTE_HASH_BITS 6
+
+struct bridge_route_hdr {
+	__le32 seq; /* 0 for messages that are not replies */
+} __packed;
+
+struct bridge_route_entry {
+	struct hlist_node hnode;
+	struct list_head node; /* in bridge_route.order */
+	u32 seq;
+	u32 portid;
+	u32 nl_seq;
+	unsigned long expires;
+};
+
+struct bridge_route {
+	spinlock_t lock; /* protects hash, order, count and next_seq */
+	DECLARE_HASHTABLE(hash, BRIDGE_ROUTE_HASH_BITS);
+	struct list_head order; /* oldest request first */
+	unsigned int count;
+	unsigned int max;
+	unsigned long timeout;
+	u32 next_seq;
+
+	/* counters */
+	u64 requests;
+	u64 replies;
+	u64 unmatched;
+	u64 expired;
+	u64 evicted;
+};
+
+/**
+ * @brief Set up an empty table
+ * @param rt Table
+ * @param max_inflight Requests kept in flight before the oldest is dropped
+ * @param timeout_ms Time the remote has to answer a request
+ */
+static inline void bridge_route_init(struct bridge_route *rt, unsigned int max_inflight,
+				     unsigned int timeout_ms)
+{
+	spin_lock_init(&rt->lock);
+	hash_init(rt->hash);
+	INIT_LIST_HEAD(&rt->order);
+	rt->max = max(max_inflight, 1U);
+	rt->timeout = msecs_to_jiffies(timeout_ms);
+}
+
+static inline void bridge_route_unlink(struct bridge_route *rt, struct bridge_route_entry *e)
+{
+	hash_del(&e->hnode);
+	list_del(&e->node);
+	rt->count--;
+}
+
+/**
+ * @brief Drop the requests the remote did not answer in time, with the lock held
+ * @param rt Table
+ * @param free List the dropped entries are moved to, freed by the caller
+ */
+static inline void bridge_route_expire(struct bridge_route *rt, struct list_head *free)
+{
+	struct bridge_route_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &rt->order, node) {
+		if (time_before(jiffies, e->expires)) {
+			break;
+		}
+		bridge_route_unlink(rt, e);
+		list_add(&e->node, free);
+		rt->expired++;
+	}
+}
+
+static inline void bridge_route_free(struct list_head *free)
+{
+	struct bridge_route_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, free, node) {
+		kfree(e);
+	}
+}
+
+/**
+ * @brief Register a request about to be sent to the remote
+ * @param rt Table
+ * @param portid Netlink port of the sender
+ * @param nl_seq nlmsg_seq of the request, returned with the reply
+ * @param seq Sequence number to put in the header of the request
+ * @return 0 or -ENOBUFS
+ */
+static inline int bridge_route_add(struct bridge_route *rt, u32 portid, u32 nl_seq, u32 *seq)
+{
+	struct bridge_route_entry *e, *old;
+	unsigned long flags;
+	LIST_HEAD(free);
+
+	e = kmalloc(sizeof(*e), GFP_KERNEL);
+	if (!e) {
+		return -ENOBUFS;
+	}
+	e->portid = portid;
+	e->nl_seq = nl_seq;
+	e->expires = jiffies + rt->timeout;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	bridge_route_expire(rt, &free);
+	if (rt->count >= rt->max) {
+		old = list_first_entry(&rt->order, struct bridge_route_entry, node);
+		bridge_route_unlink(rt, old);
+		list_add(&old->node, &free);
+		rt->evicted++;
+	}
+
+	// 0 is reserved for messages that are not replies
+	if (++rt->next_seq == 0) {
+		rt->next_seq = 1;
+	}
+	e->seq = rt->next_seq;
+	*seq = e->seq;
+	hash_add(rt->hash, &e->hnode, e->seq);
+	list_add_tail(&e->node, &rt->order);
+	rt->count++;
+	rt->requests++;
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	bridge_route_free(&free);
+
+	return 0;
+}
+
+/**
+ * @brief Take the request a message from the remote answers
+ * @param rt Table
+ * @param seq Sequence number from the header of the message
+ * @param portid Netlink port of the sender of the request
+ * @param nl_seq nlmsg_seq of the request
+ * @return true if the request was in flight, it is removed from the table
+ */
+static inline bool bridge_route_match(struct bridge_route *rt, u32 seq, u32 *portid, u32 *nl_seq)
+{
+	struct bridge_route_entry *e, *found = NULL;
+	unsigned long flags;
+	LIST_HEAD(free);
+
+	spin_lock_irqsave(&rt->lock, flags);
+	bridge_route_expire(rt, &free);
+	if (seq) {
+		hash_for_each_possible(rt->hash, e, hnode, seq) {
+			if (e->seq == seq) {
+				found = e;
+				break;
+			}
+		}
+	}
+	if (found) {
+		bridge_route_unlink(rt, found);
+		rt->replies++;
+	} else {
+		rt->unmatched++;
+	}
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	bridge_route_free(&free);
+	if (!found) {
+		return false;
+	}
+
+	*portid = found->portid;
+	*nl_seq = found->nl_seq;
+	kfree(found);
+
+	return true;
+}
+
+/**
+ * @brief Forget a request that could not be sent
+ * @param rt Table
+ * @param seq Sequence number of the request
+ */
+static inline void bridge_route_cancel(struct bridge_route *rt, u32 seq)
+{
+	struct bridge_route_entry *e;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	hash_for_each_possible(rt->hash, e, hnode, seq) {
+		if (e->seq == seq) {
+			bridge_route_unlink(rt, e);
+			rt->requests--;
+			spin_unlock_irqrestore(&rt->lock, flags);
+			kfree(e);
+			return;
+		}
+	}
+	spin_unlock_irqrestore(&rt->lock, flags);
+}
+
+static inline void bridge_route_destroy(struct bridge_route *rt)
+{
+	struct bridge_route_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &rt->order, node) {
+		kfree(e);
+	}
+	INIT_LIST_HEAD(&rt->order);
+	hash_init(rt->hash);
+	rt->count = 0;
+}
+
+static inline void bridge_route_show(struct seq_file *s, struct bridge_route *rt)
+{
+	seq_printf(s, "rt_inflight:  %u/%u\n", READ_ONCE(rt->count), rt->max);
+	seq_printf(s, "rt_requests:  %llu\n", rt->requests);
+	seq_printf(s, "rt_replies:   %llu\n", rt->replies);
+	seq_printf(s, "rt_unmatched: %llu\n", rt->unmatched);
+	seq_printf(s, "rt_expired:   %llu\n", rt->expired);
+	seq_printf(s, "rt_evicted:   %llu\n", rt->evicted);
+}
+
+#endif /* _BRIDGE_ROUTE_H */
@@ -0,0 +1,212 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Deferred rx path shared by the rpmsg bridge modules
+ *
+ * The rpmsg callback runs in the vring/mailbox context, so it only copies
+ * each message into a single producer / single consumer ring. A kthread
+ * worker drains the ring and does the delivery to userspace, as many
+ * messages per wakeup as are queued.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_RX_H
+#define _BRIDGE_RX_H
+
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/kthread.h>
+#include <linux/rpmsg.h>
+#include <linux/sched.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+
+#define BRIDGE_RX_PRIO_NORMAL   0
+#define BRIDGE_RX_PRIO_FIFO_LOW 1
+#define BRIDGE_RX_PRIO_FIFO     2
+
+struct bridge_rx_slot {
+	u32 len;
+	u8 data[];
+};
+
+struct bridge_rx {
+	/* head is only written by the producer, tail only by the consumer */
+	unsigned int head;
+	unsigned int tail;
+	unsigned int nslots;
+	unsigned int slot_size;
+	u8 *slots;
+	bool stopped;
+
+	struct kthread_worker *worker;
+	struct kthread_work work;
+	void (*deliver)(struct bridge_rx *rx, void *data, int len);
+
+	/* counters */
+	u64 queued;
+	u64 overflows;
+	u64 batches;
+	unsigned int high_water;
+};
+
+static inline struct bridge_rx_slot *bridge_rx_slot(struct bridge_rx *rx, unsigned int idx)
+{
+	return (struct bridge_rx_slot *)(rx->slots + (idx & (rx->nslots - 1)) * rx->slot_size);
+}
+
+static inline unsigned int bridge_rx_used(struct bridge_rx *rx)
+{
+	return READ_ONCE(rx->head) - READ_ONCE(rx->tail);
+}
+
+/**
+ * @brief Drain the ring, runs in the worker
+ * @param work Work of the rx path
+ */
+static inline void bridge_rx_work(struct kthread_work *work)
+{
+	struct bridge_rx *rx = container_of(work, struct bridge_rx, work);
+	struct bridge_rx_slot *slot;
+	unsigned int head = smp_load_acquire(&rx->head);
+	unsigned int tail = rx->tail;
+
+	if (head == tail) {
+		return;
+	}
+
+	rx->batches++;
+	while (tail != head) {
+		slot = bridge_rx_slot(rx, tail);
+		rx->deliver(rx, slot->data, slot->len);
+
+		/* hand the slot back before looking for more */
+		smp_store_release(&rx->tail, ++tail);
+		if (tail == head) {
+			head = smp_load_acquire(&rx->head);
+		}
+	}
+}
+
+/**
+ * @brief Copy a message into the ring and kick the worker
+ * @param rx Rx path
+ * @param data Message
+ * @param len Size of the message
+ * @return 0, -ENOBUFS if the ring is full, -EMSGSIZE or -ESHUTDOWN once stopped
+ *
+ * Must not be called concurrently, the rpmsg core serializes the callbacks
+ * of an endpoint.
+ */
+static inline int bridge_rx_queue(struct bridge_rx *rx, void *data, int len)
+{
+	struct bridge_rx_slot *slot;
+	unsigned int head = rx->head;
+	unsigned int used = head - smp_load_acquire(&rx->tail);
+
+	if (READ_ONCE(rx->stopped)) {
+		return -ESHUTDOWN;
+	}
+
+	if (len > rx->slot_size - sizeof(*slot)) {
+		rx->overflows++;
+		return -EMSGSIZE;
+	}
+
+	if (used >= rx->nslots) {
+		rx->overflows++;
+		return -ENOBUFS;
+	}
+
+	slot = bridge_rx_slot(rx, head);
+	slot->len = len;
+	memcpy(slot->data, data, len);
+	smp_store_release(&rx->head, head + 1);
+
+	rx->queued++;
+	if (used + 1 > rx->high_water) {
+		rx->high_water = used + 1;
+	}
+
+	kthread_queue_work(rx->worker, &rx->work);
+
+	return 0;
+}
+
+/**
+ * @brief Set up the ring and start the worker
+ * @param rx Rx path
+ * @param dev Device owning the ring memory
+ * @param name Name of the worker thread
+ * @param nslots Ring size, rounded up to a power of two
+ * @param msg_size Largest message, usually the mtu
+ * @param prio One of BRIDGE_RX_PRIO_*
+ * @param deliver Called from the worker for every message
+ * @return 0 or error
+ *
+ * The ring is device managed so that it outlives late callbacks between
+ * remove and the destruction of the endpoint.
+ */
+static inline int bridge_rx_init(struct bridge_rx *rx, struct device *dev, const char *name,
+				 unsigned int nslots, int msg_size, unsigned int prio,
+				 void (*deliver)(struct bridge_rx *rx, void *data, int len))
+{
+	rx->nslots = roundup_pow_of_two(max(nslots, 2U));
+	rx->slot_size = ALIGN(sizeof(struct bridge_rx_slot) + msg_size, sizeof(u32));
+	rx->slots = devm_kcalloc(dev, rx->nslots, rx->slot_size, GFP_KERNEL);
+	if (!rx->slots) {
+		return -ENOMEM;
+	}
+
+	rx->deliver = deliver;
+	kthread_init_work(&rx->work, bridge_rx_work);
+
+	rx->worker = kthread_create_worker(0, "%s", name);
+	if (IS_ERR(rx->worker)) {
+		return PTR_ERR(rx->worker);
+	}
+
+	switch (prio) {
+	case BRIDGE_RX_PRIO_FIFO:
+		sched_set_fifo(rx->worker->task);
+		break;
+	case BRIDGE_RX_PRIO_FIFO_LOW:
+		sched_set_fifo_low(rx->worker->task);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Stop the worker, messages still in the ring are delivered first
+ * @param rx Rx path
+ * @param ept Endpoint feeding the ring, NULL if it was already destroyed
+ *
+ * Callbacks of a live endpoint are fenced before the worker goes away: the
+ * ones past the stopped check are waited for, later ones see it set.
+ */
+static inline void bridge_rx_destroy(struct bridge_rx *rx, struct rpmsg_endpoint *ept)
+{
+	WRITE_ONCE(rx->stopped, true);
+	if (ept) {
+		mutex_lock(&ept->cb_lock);
+		mutex_unlock(&ept->cb_lock);
+	}
+	kthread_flush_work(&rx->work);
+	kthread_destroy_worker(rx->worker);
+}
+
+static inline void bridge_rx_show(struct seq_file *s, struct bridge_rx *rx)
+{
+	seq_printf(s, "rx_ring:      %u/%u (max %u)\n", bridge_rx_used(rx), rx->nslots,
+		   rx->high_water);
+	seq_printf(s, "rx_queued:    %llu\n", rx->queued);
+	seq_printf(s, "rx_overflows: %llu\n", rx->overflows);
+	seq_printf(s, "rx_batches:   %llu\n", rx->batches);
+}
+
+#endif /* _BRIDGE_RX_H */
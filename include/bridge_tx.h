@@ -0,0 +1,412 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Non-blocking tx path shared by the rpmsg bridge modules
+ *
+ * Clients never wait for a free rpmsg buffer: messages are queued and a
+ * worker drains the queue with rpmsg_trysendto(), retrying on the next tick
+ * while the remote holds all the buffers. A full queue is reported to the
+ * client with -EAGAIN instead of stalling it.
+ *
+ * With coalescing on, consecutive small messages share an rpmsg buffer, each
+ * one behind a struct bridge_tx_rec_hdr with its length, so a chatty client
+ * costs the remote one interrupt per buffer instead of one per message. The
+ * first message queued starts a timer, and the queue is sent when the timer
+ * expires, when it fills a buffer or on bridge_tx_flush(). Every message is
+ * framed while coalescing is on, even alone in its buffer. Fragmentation
+ * turns coalescing off.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_TX_H
+#define _BRIDGE_TX_H
+
+#include <linux/kernel.h>
+#include <linux/rpmsg.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/seq_file.h>
+
+#include "bridge_frag.h"
+
+struct bridge_tx_rec_hdr {
+	__le16 len;
+} __packed;
+
+struct bridge_tx_msg {
+	struct list_head node;
+	u16 msg_id;
+	u16 next; /* next fragment to send */
+	u16 count;
+	int len;
+	u8 data[];
+};
+
+struct bridge_tx {
+	struct rpmsg_endpoint *ept;
+	u32 dst;
+	struct bridge_frag *frag;
+	unsigned int max_depth;
+	int mtu;
+	u8 *buf; /* fragment or packed buffer being sent, worker only */
+	u64 coalesce_ns; /* 0 to send every message on its own */
+	struct hrtimer timer;
+
+	spinlock_t lock; /* protects queue, depth and bytes */
+	struct list_head queue;
+	unsigned int depth;
+	unsigned int bytes; /* size of the queue once framed */
+	bool stopped;
+	struct delayed_work work;
+
+	/* counters */
+	u64 queued;
+	u64 sent;
+	u64 full;
+	u64 errors;
+	u64 packed; /* buffers carrying coalesced messages */
+	u64 stalls;
+	u64 stall_ns;
+	unsigned int high_water;
+	bool stalled;
+	ktime_t stall_start;
+};
+
+/**
+ * @brief Send what is left of a message without blocking
+ * @param tx Tx path
+ * @param msg Message
+ * @return 0, -ENOMEM while the remote has no free buffers, or error
+ */
+static inline int bridge_tx_send_one(struct bridge_tx *tx, struct bridge_tx_msg *msg)
+{
+	int size;
+	int ret;
+
+	if (!tx->frag) {
+		return rpmsg_trysendto(tx->ept, msg->data, msg->len, tx->dst);
+	}
+
+	while (msg->next < msg->count) {
+		size = bridge_frag_build(tx->buf, tx->mtu, msg->msg_id, msg->data, msg->len,
+					 msg->next);
+		ret = rpmsg_trysendto(tx->ept, tx->buf, size, tx->dst);
+		if (ret) {
+			return ret;
+		}
+		msg->next++;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Send as many messages from the head of the queue as fit in one buffer
+ * @param tx Tx path
+ * @return 0, -ENOMEM while the remote has no free buffers, or error
+ *
+ * The messages sent, or lost with the buffer on an error, leave the queue.
+ */
+static inline int bridge_tx_send_packed(struct bridge_tx *tx)
+{
+	struct bridge_tx_msg *msg, *tmp;
+	struct bridge_tx_rec_hdr *rec;
+	unsigned long flags;
+	unsigned int count = 0;
+	LIST_HEAD(done);
+	int size = 0;
+	int ret;
+
+	// producers only append, the worker is the only one removing
+	spin_lock_irqsave(&tx->lock, flags);
+	list_for_each_entry(msg, &tx->queue, node) {
+		if (size + sizeof(*rec) + msg->len > tx->mtu) {
+			break;
+		}
+		rec = (struct bridge_tx_rec_hdr *)(tx->buf + size);
+		rec->len = cpu_to_le16(msg->len);
+		memcpy(rec + 1, msg->data, msg->len);
+		size += sizeof(*rec) + msg->len;
+		count++;
+	}
+	spin_unlock_irqrestore(&tx->lock, flags);
+
+	ret = rpmsg_trysendto(tx->ept, tx->buf, size, tx->dst);
+	if (ret == -ENOMEM) {
+		return ret;
+	}
+
+	spin_lock_irqsave(&tx->lock, flags);
+	list_for_each_entry_safe(msg, tmp, &tx->queue, node) {
+		if (!count--) {
+			break;
+		}
+		list_move_tail(&msg->node, &done);
+		tx->depth--;
+		tx->bytes -= sizeof(*rec) + msg->len;
+	}
+	spin_unlock_irqrestore(&tx->lock, flags);
+
+	if (ret) {
+		pr_err_ratelimited("bridge_tx: rpmsg_trysendto failed: %d\n", ret);
+	} else {
+		tx->packed++;
+	}
+	list_for_each_entry_safe(msg, tmp, &done, node) {
+		if (ret) {
+			tx->errors++;
+		} else {
+			tx->sent++;
+		}
+		kfree(msg);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Drain the queue, runs in the system workqueue
+ * @param work Work of the tx path
+ */
+static inline void bridge_tx_work(struct work_struct *work)
+{
+	struct bridge_tx *tx = container_of(to_delayed_work(work), struct bridge_tx, work);
+	struct bridge_tx_msg *msg;
+	unsigned long flags;
+	int ret;
+
+	for (;;) {
+		// only the worker removes messages, the head stays valid unlocked
+		spin_lock_irqsave(&tx->lock, flags);
+		msg = list_first_entry_or_null(&tx->queue, struct bridge_tx_msg, node);
+		spin_unlock_irqrestore(&tx->lock, flags);
+		if (!msg) {
+			break;
+		}
+
+		ret = tx->coalesce_ns ? bridge_tx_send_packed(tx) : bridge_tx_send_one(tx, msg);
+		if (ret == -ENOMEM) {
+			// no free buffer, try again on the next tick
+			if (!tx->stalled) {
+				tx->stalled = true;
+				tx->stall_start = ktime_get();
+				tx->stalls++;
+			}
+			if (!READ_ONCE(tx->stopped)) {
+				schedule_delayed_work(&tx->work, 1);
+			}
+			return;
+		}
+
+		if (tx->stalled) {
+			tx->stalled = false;
+			tx->stall_ns += ktime_to_ns(ktime_sub(ktime_get(), tx->stall_start));
+		}
+
+		if (tx->coalesce_ns) {
+			// already accounted and off the queue
+			continue;
+		}
+
+		if (ret) {
+			tx->errors++;
+			pr_err_ratelimited("bridge_tx: rpmsg_trysendto failed: %d\n", ret);
+		} else {
+			tx->sent++;
+		}
+
+		spin_lock_irqsave(&tx->lock, flags);
+		list_del(&msg->node);
+		tx->depth--;
+		tx->bytes -= sizeof(struct bridge_tx_rec_hdr) + msg->len;
+		spin_unlock_irqrestore(&tx->lock, flags);
+		kfree(msg);
+	}
+}
+
+static inline enum hrtimer_restart bridge_tx_timer(struct hrtimer *timer)
+{
+	struct bridge_tx *tx = container_of(timer, struct bridge_tx, timer);
+
+	mod_delayed_work(system_wq, &tx->work, 0);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief Largest message the tx path takes
+ * @param tx Tx path
+ * @param len Size of the message
+ * @return 0 or -EMSGSIZE
+ */
+static inline int bridge_tx_check(struct bridge_tx *tx, int len)
+{
+	if (tx->frag) {
+		return bridge_frag_check(tx->frag, len, tx->mtu);
+	}
+	if (len + (tx->coalesce_ns ? sizeof(struct bridge_tx_rec_hdr) : 0) > tx->mtu) {
+		return -EMSGSIZE;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Queue a message for the remote
+ * @param tx Tx path
+ * @param data Message
+ * @param len Size of the message
+ * @return 0, -EAGAIN if the queue is full, -ENOBUFS or -EMSGSIZE
+ */
+static inline int bridge_tx_queue(struct bridge_tx *tx, void *data, int len)
+{
+	struct bridge_tx_msg *msg;
+	unsigned long flags;
+	bool first;
+	bool full;
+
+	if (bridge_tx_check(tx, len)) {
+		return -EMSGSIZE;
+	}
+
+	msg = kmalloc(sizeof(*msg) + len, GFP_ATOMIC);
+	if (!msg) {
+		return -ENOBUFS;
+	}
+
+	msg->len = len;
+	msg->next = 0;
+	msg->count = tx->frag ? bridge_frag_count(len, tx->mtu) : 1;
+	memcpy(msg->data, data, len);
+
+	spin_lock_irqsave(&tx->lock, flags);
+	if (tx->depth >= tx->max_depth || tx->stopped) {
+		tx->full++;
+		spin_unlock_irqrestore(&tx->lock, flags);
+		kfree(msg);
+		return -EAGAIN;
+	}
+	if (tx->frag) {
+		// ids follow queue order
+		msg->msg_id = bridge_frag_next_id(tx->frag);
+		if (msg->count > 1) {
+			tx->frag->tx_fragmented++;
+		}
+	}
+	list_add_tail(&msg->node, &tx->queue);
+	tx->depth++;
+	tx->queued++;
+	tx->bytes += sizeof(struct bridge_tx_rec_hdr) + len;
+	if (tx->depth > tx->high_water) {
+		tx->high_water = tx->depth;
+	}
+	first = tx->depth == 1;
+	full = tx->bytes >= tx->mtu;
+	spin_unlock_irqrestore(&tx->lock, flags);
+
+	if (!tx->coalesce_ns || full) {
+		mod_delayed_work(system_wq, &tx->work, 0);
+	} else if (first) {
+		// wait for company, a busy queue is already on its way
+		hrtimer_start(&tx->timer, ns_to_ktime(tx->coalesce_ns), HRTIMER_MODE_REL_SOFT);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Send the messages held for coalescing without waiting for the timer
+ * @param tx Tx path
+ */
+static inline void bridge_tx_flush(struct bridge_tx *tx)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tx->lock, flags);
+	if (!tx->stopped && tx->depth) {
+		hrtimer_try_to_cancel(&tx->timer);
+		mod_delayed_work(system_wq, &tx->work, 0);
+	}
+	spin_unlock_irqrestore(&tx->lock, flags);
+}
+
+/**
+ * @brief Set up the tx path of an endpoint
+ * @param tx Tx path
+ * @param dev Device owning the fragment buffer
+ * @param ept Endpoint to send on
+ * @param dst Remote address
+ * @param frag Fragmentation state, or NULL to send messages as they are
+ * @param max_depth Messages queued before clients get -EAGAIN
+ * @param coalesce_us Time small messages wait for others to share their buffer,
+ *                    0 or with frag to send every message on its own
+ * @return 0 or error
+ */
+static inline int bridge_tx_init(struct bridge_tx *tx, struct device *dev,
+				 struct rpmsg_endpoint *ept, u32 dst, struct bridge_frag *frag,
+				 unsigned int max_depth, unsigned int coalesce_us)
+{
+	tx->ept = ept;
+	tx->dst = dst;
+	tx->frag = frag;
+	tx->max_depth = max_depth;
+	tx->mtu = rpmsg_get_mtu(ept);
+	tx->coalesce_ns = frag ? 0 : (u64)coalesce_us * NSEC_PER_USEC;
+	spin_lock_init(&tx->lock);
+	INIT_LIST_HEAD(&tx->queue);
+	INIT_DELAYED_WORK(&tx->work, bridge_tx_work);
+	hrtimer_init(&tx->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	tx->timer.function = bridge_tx_timer;
+
+	if (frag || tx->coalesce_ns) {
+		tx->buf = devm_kmalloc(dev, tx->mtu, GFP_KERNEL);
+		if (!tx->buf) {
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Stop the worker and drop what was not sent
+ * @param tx Tx path
+ */
+static inline void bridge_tx_destroy(struct bridge_tx *tx)
+{
+	struct bridge_tx_msg *msg, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tx->lock, flags);
+	tx->stopped = true;
+	spin_unlock_irqrestore(&tx->lock, flags);
+
+	hrtimer_cancel(&tx->timer);
+	cancel_delayed_work_sync(&tx->work);
+
+	list_for_each_entry_safe(msg, tmp, &tx->queue, node) {
+		list_del(&msg->node);
+		kfree(msg);
+	}
+	tx->depth = 0;
+	tx->bytes = 0;
+}
+
+static inline void bridge_tx_show(struct seq_file *s, struct bridge_tx *tx)
+{
+	seq_printf(s, "tx_queue:     %u/%u (max %u)\n", READ_ONCE(tx->depth), tx->max_depth,
+		   tx->high_water);
+	seq_printf(s, "tx_queued:    %llu\n", tx->queued);
+	seq_printf(s, "tx_sent:      %llu\n", tx->sent);
+	seq_printf(s, "tx_full:      %llu\n", tx->full);
+	seq_printf(s, "tx_errors:    %llu\n", tx->errors);
+	seq_printf(s, "tx_packed:    %llu\n", tx->packed);
+	seq_printf(s, "tx_stalls:    %llu\n", tx->stalls);
+	seq_printf(s, "tx_stall_us:  %llu\n", div_u64(tx->stall_ns, NSEC_PER_USEC));
+}
+
+#endif /* _BRIDGE_TX_H */
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Wire header of the messages between the bridges and the remote
+ *
+ * With the header on, every message in either direction starts with a
+ * struct bridge_wire_hdr, in little endian, followed by len bytes of
+ * payload. The kernel can then tell data from control messages, route
+ * replies and timestamp messages without looking into the payload. Clients
+ * only ever see the payload.
+ *
+ * version is BRIDGE_WIRE_VERSION, messages with another one are dropped.
+ * seq identifies a request, the remote answers it with the same seq; it is
+ * 0 for messages that expect no answer. timestamp is CLOCK_MONOTONIC of the
+ * sender in ns, or 0. flags is reserved and 0.
+ *
+ * The header sits above fragmentation and tx coalescing: a message is
+ * framed first, then split or packed with others.
+ *
+ * This header is also meant to be included from userspace and firmware.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#ifndef _BRIDGE_WIRE_H
+#define _BRIDGE_WIRE_H
+
+#include <linux/types.h>
+
+#define BRIDGE_WIRE_VERSION 1
+
+enum bridge_wire_type {
+	BRIDGE_WIRE_DATA,   /* payload for the application */
+	BRIDGE_WIRE_HELLO,  /* Linux opened the endpoint, no payload */
+	BRIDGE_WIRE_CREDIT, /* credit grant, struct bridge_credit_grant */
+};
+
+struct bridge_wire_hdr {
+	__u8 version;
+	__u8 type;
+	__le16 flags;
+	__le32 seq;
+	__le64 timestamp;
+	__le32 len; /* payload after the header */
+} __attribute__((packed));
+
+#ifdef __KERNEL__
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+
+struct bridge_wire {
+	/* counters, only updated by the rx worker */
+	u64 rx_errors;  /* short messages or unknown versions */
+	u64 rx_control; /* messages that were not data */
+};
+
+/**
+ * @brief Build a framed message
+ * @param type BRIDGE_WIRE_*
+ * @param seq Request the message is, or answers, 0 for none
+ * @param data Payload
+ * @param len Size of the payload
+ * @param size Size of the framed message
+ * @return Message to kfree() once sent, or NULL
+ */
+static inline void *bridge_wire_build(u8 type, u32 seq, const void *data, int len, int *size)
+{
+	struct bridge_wire_hdr *hdr;
+
+	hdr = kmalloc(sizeof(*hdr) + len, GFP_KERNEL);
+	if (!hdr) {
+		return NULL;
+	}
+
+	hdr->version = BRIDGE_WIRE_VERSION;
+	hdr->type = type;
+	hdr->flags = 0;
+	hdr->seq = cpu_to_le32(seq);
+	hdr->timestamp = cpu_to_le64(ktime_get_ns());
+	hdr->len = cpu_to_le32(len);
+	if (len) {
+		memcpy(hdr + 1, data, len);
+	}
+	*size = sizeof(*hdr) + len;
+
+	return hdr;
+}
+
+/**
+ * @brief Check the header of a message from the remote and strip it
+ * @param w Wire state
+ * @param data Message, moved to the payload
+ * @param len Size of the message, replaced by the size of the payload
+ * @return Header, or NULL for a malformed message
+ */
+static inline struct bridge_wire_hdr *bridge_wire_rx(struct bridge_wire *w, void **data, int *len)
+{
+	struct bridge_wire_hdr *hdr = *data;
+
+	if (*len < (int)sizeof(*hdr) || hdr->version != BRIDGE_WIRE_VERSION ||
+	    le32_to_cpu(hdr->len) > *len - sizeof(*hdr)) {
+		w->rx_errors++;
+		return NULL;
+	}
+
+	*data = hdr + 1;
+	*len = le32_to_cpu(hdr->len);
+	if (hdr->type != BRIDGE_WIRE_DATA) {
+		w->rx_control++;
+	}
+
+	return hdr;
+}
+
+static inline void bridge_wire_show(struct seq_file *s, struct bridge_wire *w)
+{
+	seq_printf(s, "wire_errors:  %llu\n", w->rx_errors);
+	seq_printf(s, "wire_control: %llu\n", w->rx_control);
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* _BRIDGE_WIRE_H */
@@ -3,24 +3,48 @@
  * Remote processor messaging module with netlink
  * and a character device
  *
+ * Every rpmsg channel of the service is an instance with its own character
+ * device (DEVICE_NAME for the first one, DEVICE_NAME<n> for the others),
+ * queues and counters. Netlink clients talk to it through the generic
+ * netlink family GENL_NAME, described in bridge_genl.h. Userspace may add
+ * endpoints to a channel at runtime with BRIDGE_IOC_CREATE_EPT, each one is
+ * an instance of its own. With credits set, the remote only sends as many
+ * messages as userspace has taken, as described in bridge_credit.h. With
+ * wire set, every message carries the header of bridge_wire.h.
+ *
  * Marcos Raimondi <marcosraimondi1@gmail.com>
  */
 
 #include "linux/device.h"
 #include <linux/printk.h>
-#include <net/sock.h>
+#include <net/genetlink.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/rpmsg.h>
-#include <linux/netlink.h>
 #include <linux/skbuff.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "bridge_rx.h"
+#include "bridge_frag.h"
+#include "bridge_tx.h"
+#include "bridge_msgq.h"
+#include "bridge_batch.h"
+#include "bridge_mmap.h"
+#include "bridge_chan.h"
+#include "bridge_genl.h"
+#include "bridge_credit.h"
+#include "bridge_wire.h"
 
-#define NETLINK_USER        19
+#define GENL_NAME           "rpmsg_kws"
 #define RPMSG_ENDPOINT_NAME "kws-app"
 #define DRIVER_NAME         "kws-mod"
 
@@ -28,61 +52,307 @@
 #define DEVICE_NAME "kws_char_dev"
 #define BUFFER_SIZE 1024
 
-static struct cdev rpmsg_cdev;
+// mayor mensaje aceptado de los clientes del dispositivo de caracter
+#define MSG_MAX_LEN \
+	((frag ? frag_max : BUFFER_SIZE) - (wire ? sizeof(struct bridge_wire_hdr) : 0))
+
 static dev_t dev_num;
-static char msg_buffer[BUFFER_SIZE];
-static int msg_len;
 static struct class *rpmsg_class;
-static struct device *rpmsg_device;
+static struct genl_family nl_family;
+static struct bridge_chan_table chans;
+static struct dentry *dbg_root;
+
+static unsigned int queue_len = 64;
+module_param(queue_len, uint, 0444);
+MODULE_PARM_DESC(queue_len, "Messages kept for the readers of the char device "
+			    "(rounded up to a power of two)");
+
+static unsigned int mmap_slots = 256;
+module_param(mmap_slots, uint, 0444);
+MODULE_PARM_DESC(mmap_slots, "Slots of the mmap'able rx ring (0 = no ring)");
+
+static unsigned int mmap_slot_size = 504;
+module_param(mmap_slot_size, uint, 0444);
+MODULE_PARM_DESC(mmap_slot_size, "Largest message stored in a slot of the mmap'able rx ring");
+
+static unsigned int rx_slots = 64;
+module_param(rx_slots, uint, 0444);
+MODULE_PARM_DESC(rx_slots, "Messages buffered between the rpmsg callback and the rx worker");
+
+static unsigned int rx_prio = BRIDGE_RX_PRIO_NORMAL;
+module_param(rx_prio, uint, 0444);
+MODULE_PARM_DESC(rx_prio, "Rx worker scheduling: 0 = normal, 1 = SCHED_FIFO low, 2 = SCHED_FIFO");
+
+static unsigned int tx_queue = 64;
+module_param(tx_queue, uint, 0444);
+MODULE_PARM_DESC(tx_queue, "Messages queued towards the remote before senders get -EAGAIN "
+			   "(0 = wait in rpmsg_send)");
+
+static unsigned int tx_coalesce_us;
+module_param(tx_coalesce_us, uint, 0444);
+MODULE_PARM_DESC(tx_coalesce_us, "Pack small messages queued within this time into one rpmsg "
+				 "buffer, needs tx_queue and no frag (0 = off)");
+
+static bool frag;
+module_param(frag, bool, 0444);
+MODULE_PARM_DESC(frag, "Frame messages with a fragment header, allows messages over the mtu");
+
+static unsigned int frag_max = 16384;
+module_param(frag_max, uint, 0444);
+MODULE_PARM_DESC(frag_max, "Largest fragmented message in either direction");
+
+static unsigned int frag_timeout_ms = 500;
+module_param(frag_timeout_ms, uint, 0444);
+MODULE_PARM_DESC(frag_timeout_ms, "Time allowed to receive all the fragments of a message");
+
+static unsigned int credits;
+module_param(credits, uint, 0444);
+MODULE_PARM_DESC(credits, "Messages the remote may send ahead of userspace, up to rx_slots and "
+			  "queue_len (0 = no flow control)");
+
+static bool wire;
+module_param(wire, bool, 0444);
+MODULE_PARM_DESC(wire, "Frame every message with the versioned header of bridge_wire.h");
 
-struct rpmsg_device *rpmsg_dev = NULL;
 struct driver_data {
-	struct sock *nl_sk;
-	int client_pid;
+	struct kref ref; /* probe or parent, every open file and every endpoint */
+	int id;
+	struct rpmsg_device __rcu *rpdev; /* NULL once the instance is stopped */
+	struct rpmsg_endpoint *ept;
+	u32 dst;
+	bool started; /* callbacks are dropped while clear */
+	spinlock_t client_lock; /* the client and its filter change together */
+	u32 client_pid; /* port receiving the messages of the channel */
+	struct bridge_filter __rcu *client_filter;
+	u64 filtered; /* messages the filter of the client dropped */
+
+	// Endpoints creados desde userspace, solo en los canales
+	struct driver_data *parent;
+	struct list_head node; /* in parent->epts */
+	struct mutex ept_lock; /* protects epts */
+	struct list_head epts;
+
+	// Dispositivo de caracter del canal, un archivo abierto lo mantiene vivo
+	// mas alla de estos datos
+	struct cdev *cdev;
+	struct device *chardev;
+	struct bridge_msgq rx_queue;
+	struct bridge_mmap rx_ring;
+
+	struct bridge_rx rx;
+	struct bridge_frag frag;
+	struct bridge_tx tx;
+	struct bridge_credit credit;
+	struct bridge_wire wire;
+	struct dentry *dbg;
 };
 
+static int send_wire(struct driver_data *data, u8 type, void *msg, int len, bool nowait);
+static int ept_create(struct driver_data *parent, void __user *arg);
+static int ept_destroy(struct driver_data *data);
+
+static void driver_data_release(struct kref *ref)
+{
+	struct driver_data *data = container_of(ref, struct driver_data, ref);
+
+	if (data->parent) {
+		kref_put(&data->parent->ref, driver_data_release);
+	}
+	bridge_msgq_destroy(&data->rx_queue);
+	bridge_mmap_free(&data->rx_ring);
+	kfree(data);
+}
+
+static struct driver_data *file_data(struct file *filep)
+{
+	struct bridge_msgq_reader *reader = filep->private_data;
+
+	return container_of(reader->q, struct driver_data, rx_queue);
+}
+
 /**
- * @brief Leer el mensaje desde el dispositivo de caracter
- * @param filep Puntero al archivo
- * @param buffer Puntero al buffer en el espacio de usuario
- * @param len Tamano del buffer
- * @param offset Puntero al offset
- * @return Numero de bytes leidos
+ * @brief Enviar al procesador remoto un mensaje escrito en el dispositivo de caracter
+ * @param priv Datos del canal
+ * @param msg Mensaje
+ * @param len Tamano del mensaje
+ * @return 0 o error
  */
-static ssize_t rpmsg_dev_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset)
+static int rpmsg_dev_send(void *priv, void *msg, int len)
 {
-	int ret;
+	struct driver_data *data = priv;
+	struct rpmsg_device *rpdev;
+	int idx, ret;
 
-	// Verificar si ya se ley0 el mensaje completo
-	if (*offset >= msg_len) {
-		return 0; // Fin del archivo
+	// remove() espera a que terminen los envios en curso
+	idx = srcu_read_lock(&chans.srcu);
+	rpdev = srcu_dereference(data->rpdev, &chans.srcu);
+	if (rpdev) {
+		ret = send_wire(data, BRIDGE_WIRE_DATA, msg, len, false);
+	} else {
+		pr_err("rpmsg_char_dev: Dispositivo RPMsg no disponible\n");
+		ret = -ENODEV;
 	}
+	srcu_read_unlock(&chans.srcu, idx);
 
-	// Ajustar la longitud si es necesario
-	if (len > msg_len - *offset) {
-		len = msg_len - *offset;
-	}
+	return ret;
+}
 
-	// Copiar el mensaje al espacio de usuario
-	ret = copy_to_user(buffer, msg_buffer + *offset, len);
-	if (ret) {
-		pr_err("rpmsg_char_dev: Error al copiar los datos al espacio de usuario\n");
-		return -EFAULT;
-	}
+/**
+ * @brief Escribir mensajes al dispositivo de caracter y enviarlos al procesador remoto
+ * @param iocb Operacion de escritura
+ * @param from Datos del usuario, cada iovec es un mensaje
+ * @return Numero de bytes escritos o error
+ *
+ * write() envia un mensaje y writev() uno por iovec. Si un mensaje falla se
+ * devuelven los bytes de los mensajes anteriores, que ya se enviaron.
+ */
+static ssize_t rpmsg_dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return bridge_write_iter(from, MSG_MAX_LEN, rpmsg_dev_send, file_data(iocb->ki_filp));
+}
 
-	// Actualizar el offset
-	*offset += len;
+/**
+ * @brief Leer mensajes del dispositivo de caracter
+ * @param iocb Operacion de lectura
+ * @param to Buffers del usuario, cada iovec recibe un mensaje
+ * @return Numero de bytes leidos o error
+ *
+ * read() lee un mensaje y readv() uno por iovec; lo que no entra de un mensaje
+ * se descarta. Solo el primer mensaje bloquea, salvo con O_NONBLOCK.
+ */
+static ssize_t rpmsg_dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
 
-	return len;
+	return bridge_read_iter(iocb->ki_filp->private_data, to, nonblock);
 }
 
+/**
+ * @brief Informar si hay mensajes para leer
+ * @param filep Puntero al archivo
+ * @param wait Tabla de poll
+ * @return EPOLLIN si hay mensajes
+ */
+static __poll_t rpmsg_dev_poll(struct file *filep, poll_table *wait)
+{
+	return bridge_msgq_poll(filep->private_data, filep, wait) |
+	       bridge_mmap_poll(&file_data(filep)->rx_ring, filep, wait);
+}
+
+/**
+ * @brief Mapear el anillo de recepcion en el espacio de usuario
+ * @param filep Puntero al archivo
+ * @param vma Area a mapear, debe cubrir el anillo completo
+ * @return 0 o error
+ *
+ * Mientras el anillo este mapeado los mensajes se entregan en el y no por read().
+ */
+static int rpmsg_dev_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	return bridge_mmap_mmap(&file_data(filep)->rx_ring, vma);
+}
+
+/**
+ * @brief Comandos del dispositivo de caracter
+ * @param filep Puntero al archivo
+ * @param cmd BRIDGE_IOC_SET_EVENTFD, BRIDGE_IOC_SUBMIT_BATCH, BRIDGE_IOC_RECV_BATCH,
+ *            BRIDGE_IOC_CREATE_EPT, BRIDGE_IOC_DESTROY_EPT, BRIDGE_IOC_SET_FILTER o
+ *            BRIDGE_IOC_FLUSH
+ * @param arg Descriptor del eventfd (-1 para quitarlo), puntero a struct bridge_batch,
+ *            a struct bridge_ept_info o a struct bridge_filter_info
+ * @return 0, numero de mensajes procesados o error
+ */
+static long rpmsg_dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct driver_data *data = file_data(filep);
+	struct bridge_filter_info info;
+	struct bridge_filter *f;
+
+	switch (cmd) {
+	case BRIDGE_IOC_SET_EVENTFD:
+		if (!data->rx_ring.ctrl) {
+			return -ENODEV;
+		}
+		return bridge_mmap_set_eventfd(&data->rx_ring, (int)arg);
+	case BRIDGE_IOC_SUBMIT_BATCH:
+		return bridge_submit_batch((void __user *)arg, MSG_MAX_LEN, rpmsg_dev_send, data);
+	case BRIDGE_IOC_RECV_BATCH:
+		return bridge_recv_batch(filep->private_data, (void __user *)arg,
+					 filep->f_flags & O_NONBLOCK);
+	case BRIDGE_IOC_CREATE_EPT:
+		return ept_create(data, (void __user *)arg);
+	case BRIDGE_IOC_DESTROY_EPT:
+		return ept_destroy(data);
+	case BRIDGE_IOC_SET_FILTER:
+		// El filtro es del lector, los demas archivos siguen recibiendo todo
+		if (copy_from_user(&info, (void __user *)arg, sizeof(info))) {
+			return -EFAULT;
+		}
+		f = bridge_filter_from_user(&info);
+		if (IS_ERR(f)) {
+			return PTR_ERR(f);
+		}
+		bridge_msgq_set_filter(filep->private_data, f);
+		return 0;
+	case BRIDGE_IOC_FLUSH:
+		// Enviar ya los mensajes que esperan para compartir un buffer
+		if (tx_queue) {
+			bridge_tx_flush(&data->tx);
+		}
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/**
+ * @brief Abrir el dispositivo de caracter
+ * @param inodep Puntero al inodo, su minor identifica el canal
+ * @param filep Puntero al archivo, guarda el cursor del lector en private_data
+ * @return 0, -ENODEV si el canal ya se elimino, o error
+ *
+ * Cada archivo abierto lee todos los mensajes con su propio cursor, varios
+ * procesos pueden seguir el mismo flujo. El archivo mantiene vivos los datos
+ * del canal aunque el canal se elimine.
+ */
 static int rpmsg_dev_open(struct inode *inodep, struct file *filep)
 {
+	struct bridge_msgq_reader *reader;
+	struct driver_data *data;
+	int idx;
+
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader) {
+		return -ENOMEM;
+	}
+
+	// El cdev puede sobrevivir al canal, los datos se buscan por el minor
+	idx = srcu_read_lock(&chans.srcu);
+	data = bridge_chan_get(&chans, iminor(inodep));
+	if (data) {
+		kref_get(&data->ref);
+		bridge_msgq_reader_init(reader, &data->rx_queue);
+	}
+	srcu_read_unlock(&chans.srcu, idx);
+
+	if (!data) {
+		kfree(reader);
+		return -ENODEV;
+	}
+	filep->private_data = reader;
+
 	return 0;
 }
 
 static int rpmsg_dev_release(struct inode *inodep, struct file *filep)
 {
+	struct driver_data *data = file_data(filep);
+	struct bridge_msgq_reader *reader = filep->private_data;
+
+	bridge_msgq_reader_release(reader);
+	kfree(reader);
+	kref_put(&data->ref, driver_data_release);
+
 	return 0;
 }
 
@@ -90,90 +360,356 @@ static int rpmsg_dev_release(struct inode *inodep, struct file *filep)
 static struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.open = rpmsg_dev_open,
-	.read = rpmsg_dev_read,
+	.read_iter = rpmsg_dev_read_iter,
+	.write_iter = rpmsg_dev_write_iter,
+	.poll = rpmsg_dev_poll,
+	.mmap = rpmsg_dev_mmap,
+	.unlocked_ioctl = rpmsg_dev_ioctl,
 	.release = rpmsg_dev_release,
 };
 
 /**
  * @brief Send a message to userspace
+ * @param data Device data
  * @param msg Message to send
  * @param msg_size Size of the message
- * @param pid Process ID of the user
+ * @param pid Process ID of the user, 0 for the members of the rx group
+ * @return 0 if somebody got the message, or error
  */
-static void send_msg_to_userspace(char *msg, int msg_size, struct sock *nl_sock, int pid)
+static int send_msg_to_userspace(struct driver_data *data, char *msg, int msg_size, u32 pid)
 {
-	struct nlmsghdr *nlh;
 	struct sk_buff *skb_out;
 	int res;
 
 	// create reply
-	skb_out = nlmsg_new(msg_size, 0);
+	skb_out = nlmsg_new(bridge_genl_msg_size(msg_size), 0);
 	if (!skb_out) {
 		pr_err("rpmsg_netlink: Failed to allocate new skb\n");
-		return;
+		return -ENOMEM;
 	}
 
 	// put received message into reply
-	nlh = nlmsg_put(skb_out, 0, 0, NLMSG_DONE, msg_size, 0);
-	NETLINK_CB(skb_out).dst_group = 0; /* not in mcast group */
-	memcpy(nlmsg_data(nlh), msg, msg_size);
+	if (bridge_genl_put_msg(skb_out, &nl_family, 0, 0, data->id, msg, msg_size)) {
+		nlmsg_free(skb_out);
+		pr_err("rpmsg_netlink: Message too long for the skb\n");
+		return -EMSGSIZE;
+	}
+
+	pr_debug("rpmsg_netlink: Sending user %d bytes\n", msg_size);
 
-	pr_debug("rpmsg_netlink: Sending user %s\n", msg);
+	if (!pid) {
+		// netlink clones it for every member, nobody listening is not an error
+		return genlmsg_multicast(&nl_family, skb_out, 0, BRIDGE_GENL_GRP_RX, GFP_KERNEL);
+	}
 
-	res = nlmsg_unicast(nl_sock, skb_out, pid);
+	res = genlmsg_unicast(&init_net, skb_out, pid);
 	if (res < 0) {
 		pr_err("rpmsg_netlink: Error while sending skb to user\n");
 	}
+
+	return res;
 }
 
 /**
  * @brief Send a message to the remote processor
- * @param rpdev Remote processor device
+ * @param data Channel or endpoint to send on
  * @param msg Message to send
  * @param len Size of the message
+ * @param nowait Fail with -ENOMEM instead of waiting for a tx buffer
+ * @return 0 or error
  */
-static void send_rpmsg(struct rpmsg_device *rpdev, char *msg, int len)
+static int send_rpmsg(struct driver_data *data, char *msg, int len, bool nowait)
 {
 	int ret;
-	long int mtu = rpmsg_get_mtu(rpdev->ept);
+	long int mtu = rpmsg_get_mtu(data->ept);
 
 	pr_debug("rpmsg_netlink: Sending %d bytes to remote (mtu=%ld)\n", len, mtu);
 
+	if (tx_queue) {
+		// never waits for the remote, a full queue is returned to the client
+		return bridge_tx_queue(&data->tx, msg, len);
+	}
+
+	if (frag) {
+		ret = bridge_frag_send(&data->frag, data->ept, data->dst, msg, len, nowait);
+		if (ret && !(nowait && ret == -ENOMEM)) {
+			pr_err("rpmsg_netlink: Fragmented send failed: %d\n", ret);
+		}
+		return ret;
+	}
+
 	if (len > mtu) {
 		pr_err("rpmsg_netlink: Message too long\n");
-		return;
+		return -EMSGSIZE;
 	}
 
-	ret = rpmsg_send(rpdev->ept, msg, len);
+	if (nowait) {
+		ret = rpmsg_trysendto(data->ept, msg, len, data->dst);
+	} else {
+		ret = rpmsg_sendto(data->ept, msg, len, data->dst);
+	}
 
-	if (ret) {
+	if (ret && !(nowait && ret == -ENOMEM)) {
 		pr_err("rpmsg_netlink: rpmsg_send failed: %d\n", ret);
-		return;
+		return ret;
 	}
+
+	return 0;
 }
 
 /**
- * @brief Callback for netlink messages received from userspace
+ * @brief Send a message to the remote, behind the wire header if it is on
+ * @param data Channel or endpoint to send on
+ * @param type BRIDGE_WIRE_*
+ * @param msg Payload
+ * @param len Size of the payload
+ * @param nowait Fail with -ENOMEM instead of waiting for a tx buffer
+ * @return 0 or error
+ *
+ * Without the header the payload goes alone, and a hello is the empty
+ * string older firmware waits for.
+ */
+static int send_wire(struct driver_data *data, u8 type, void *msg, int len, bool nowait)
+{
+	char empty_msg[] = "";
+	void *buf;
+	int size;
+	int ret;
+
+	if (!wire) {
+		if (type == BRIDGE_WIRE_HELLO) {
+			return send_rpmsg(data, empty_msg, sizeof(empty_msg), nowait);
+		}
+		return send_rpmsg(data, msg, len, nowait);
+	}
+
+	buf = bridge_wire_build(type, 0, msg, len, &size);
+	if (!buf) {
+		return -ENOBUFS;
+	}
+	ret = send_rpmsg(data, buf, size, nowait);
+	kfree(buf);
+
+	return ret;
+}
+
+/**
+ * @brief Send a credit grant to the remote
+ * @param c Credits of the channel or endpoint
+ * @param msg Grant
+ * @param len Size of the grant
+ * @return 0 or error
+ *
+ * Runs from the credit work, which retries a grant that found no tx buffer
+ * instead of waiting for one.
+ */
+static int credit_send(struct bridge_credit *c, void *msg, int len)
+{
+	struct driver_data *data = container_of(c, struct driver_data, credit);
+	int ret;
+
+	ret = send_wire(data, BRIDGE_WIRE_CREDIT, msg, len, true);
+	if (!ret && tx_queue) {
+		// the remote may be waiting for it
+		bridge_tx_flush(&data->tx);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Return the credits of the messages read from the character device
+ * @param q Read queue of the channel or endpoint
+ * @param n Messages the furthest reader moved on
+ */
+static void credit_read(struct bridge_msgq *q, unsigned int n)
+{
+	bridge_credit_consume(&container_of(q, struct driver_data, rx_queue)->credit, n);
+}
+
+/**
+ * @brief BRIDGE_CMD_SEND, forward a message to the remote
  * @param skb Socket buffer
+ * @param info Request, validated against bridge_genl_policy
+ * @return 0 or error, reported to the client in the ack
+ *
+ * Backpressure from the tx queue is returned as -EAGAIN or -ENOBUFS, the
+ * client has to retry.
  */
-static void netlink_recv_cb(struct sk_buff *skb)
+static int genl_send_doit(struct sk_buff *skb, struct genl_info *info)
 {
-	struct nlmsghdr *nlh;
-	int msg_size;
-	char *msg;
+	struct nlattr *attr = info->attrs[BRIDGE_ATTR_DATA];
+	struct rpmsg_device *rpdev;
+	struct driver_data *data;
+	bool new_client;
+	u32 flags;
+	int ret;
+	int idx;
+	int id;
+
+	id = bridge_genl_parse(info, &flags);
+	if (id < 0) {
+		return id;
+	}
+	if (!attr) {
+		GENL_SET_ERR_MSG(info, "missing data");
+		return -EINVAL;
+	}
+
+	idx = srcu_read_lock(&chans.srcu);
+
+	data = bridge_chan_get(&chans, id);
+	rpdev = data ? srcu_dereference(data->rpdev, &chans.srcu) : NULL;
+	if (rpdev) {
+		new_client = false;
+		if (!(flags & BRIDGE_F_NO_REPLY)) {
+			spin_lock(&data->client_lock);
+			if (data->client_pid != info->snd_portid) {
+				// the filter belonged to the previous client
+				data->client_pid = info->snd_portid;
+				bridge_filter_swap(&data->client_filter, NULL);
+				new_client = true;
+			}
+			spin_unlock(&data->client_lock);
+		}
+		if (new_client && credits) {
+			// what was held back is stale, let the remote send again
+			bridge_credit_consume_all(&data->credit);
+		}
+		pr_debug("rpmsg_netlink: Received %d bytes from port %u\n", nla_len(attr),
+			 info->snd_portid);
+		ret = send_wire(data, BRIDGE_WIRE_DATA, nla_data(attr), nla_len(attr), false);
+		if (!ret && (flags & BRIDGE_F_FLUSH) && tx_queue) {
+			bridge_tx_flush(&data->tx);
+		}
+	} else {
+		ret = -ENODEV;
+	}
+
+	srcu_read_unlock(&chans.srcu, idx);
 
-	struct driver_data *data = dev_get_drvdata(&rpmsg_dev->dev);
+	return ret;
+}
 
-	nlh = (struct nlmsghdr *)skb->data;
-	data->client_pid = nlh->nlmsg_pid; /* pid of sending process */
-	msg = (char *)nlmsg_data(nlh);
-	msg_size = nlmsg_len(nlh);
+/**
+ * @brief Fill the answer to BRIDGE_CMD_STATS
+ * @param skb Answer
+ * @param info Request
+ * @param data Device data
+ * @return 0 or -EMSGSIZE
+ */
+static int stats_fill(struct sk_buff *skb, struct genl_info *info, struct driver_data *data)
+{
+	struct nlattr *nest;
+	void *hdr;
 
-	pr_debug("rpmsg_netlink: Received from pid %d: %s\n", data->client_pid, msg);
+	hdr = genlmsg_put_reply(skb, info, &nl_family, 0, BRIDGE_CMD_STATS);
+	if (!hdr || nla_put_u32(skb, BRIDGE_ATTR_CHANNEL, data->id)) {
+		return -EMSGSIZE;
+	}
 
-	if (rpmsg_dev) {
-		send_rpmsg(rpmsg_dev, msg, msg_size);
+	nest = nla_nest_start(skb, BRIDGE_ATTR_STATS);
+	if (!nest || bridge_genl_put_rx(skb, &data->rx) ||
+	    bridge_genl_put_msgq(skb, &data->rx_queue) ||
+	    bridge_genl_put_stat(skb, BRIDGE_STAT_NL_FILTERED, data->filtered) ||
+	    (tx_queue && bridge_genl_put_tx(skb, &data->tx)) ||
+	    (credits && bridge_genl_put_credit(skb, &data->credit))) {
+		return -EMSGSIZE;
 	}
+	nla_nest_end(skb, nest);
+	genlmsg_end(skb, hdr);
+
+	return 0;
+}
+
+/**
+ * @brief BRIDGE_CMD_STATS, answer with the counters of a channel
+ * @param skb Socket buffer
+ * @param info Request
+ * @return 0 or error
+ */
+static int genl_stats_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct driver_data *data;
+	struct sk_buff *msg;
+	u32 flags;
+	int ret;
+	int idx;
+	int id;
+
+	id = bridge_genl_parse(info, &flags);
+	if (id < 0) {
+		return id;
+	}
+
+	msg = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg) {
+		return -ENOMEM;
+	}
+
+	idx = srcu_read_lock(&chans.srcu);
+	data = bridge_chan_get(&chans, id);
+	ret = data ? stats_fill(msg, info, data) : -ENODEV;
+	srcu_read_unlock(&chans.srcu, idx);
+
+	if (ret) {
+		nlmsg_free(msg);
+		return ret;
+	}
+
+	return genlmsg_reply(msg, info);
+}
+
+/**
+ * @brief BRIDGE_CMD_SUBSCRIBE, receive the messages of a channel without sending
+ * @param skb Socket buffer
+ * @param info Request, with the filter of the subscriber if it has one
+ * @return 0 or error
+ */
+static int genl_subscribe_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct bridge_filter *filter;
+	struct driver_data *data;
+	u32 flags;
+	int ret = 0;
+	int idx;
+	int id;
+
+	id = bridge_genl_parse(info, &flags);
+	if (id < 0) {
+		return id;
+	}
+	filter = bridge_genl_filter(info);
+	if (IS_ERR(filter)) {
+		return PTR_ERR(filter);
+	}
+
+	idx = srcu_read_lock(&chans.srcu);
+	data = bridge_chan_get(&chans, id);
+	if (!data) {
+		ret = -ENODEV;
+	} else if (!(flags & BRIDGE_F_UNSUBSCRIBE)) {
+		spin_lock(&data->client_lock);
+		data->client_pid = info->snd_portid;
+		bridge_filter_swap(&data->client_filter, filter);
+		spin_unlock(&data->client_lock);
+		filter = NULL;
+		if (credits) {
+			bridge_credit_consume_all(&data->credit);
+		}
+	} else {
+		spin_lock(&data->client_lock);
+		if (data->client_pid == info->snd_portid) {
+			data->client_pid = 0;
+			bridge_filter_swap(&data->client_filter, NULL);
+		}
+		spin_unlock(&data->client_lock);
+	}
+	srcu_read_unlock(&chans.srcu, idx);
+
+	bridge_filter_free(filter);
+
+	return ret;
 }
 
 /**
@@ -181,40 +717,527 @@ static void netlink_recv_cb(struct sk_buff *skb)
  * @param rpdev Remote processor device
  * @param data Data received
  * @param len Size of the data
- * @param priv Private data
+ * @param priv Endpoint created from userspace, NULL for the channel
  * @param src Source of the message
  * @return 0
  */
 static int rpmsg_recv_cb(struct rpmsg_device *rpdev, void *data, int len, void *priv, u32 src)
 {
 	struct driver_data *drv_data;
+	int ret;
+
+	pr_debug("rpmsg_netlink: (src: 0x%x) %d bytes\n", src, len);
+
+	drv_data = priv ? priv : dev_get_drvdata(&rpdev->dev);
+	if (!drv_data || !smp_load_acquire(&drv_data->started)) {
+		return 0;
+	}
+	ret = bridge_rx_queue(&drv_data->rx, data, len);
+	if (ret && ret != -ESHUTDOWN) {
+		pr_err_ratelimited("rpmsg_netlink: Rx ring full, message dropped\n");
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Read the client of a channel and run its filter on a message
+ * @param data Device data
+ * @param msg Message
+ * @param len Size of the message
+ * @param pid Port of the client, 0 for none
+ * @return true if there is no client or its filter takes the message
+ *
+ * The port and the filter are read together, so a client never gets the
+ * filter of the one before it.
+ */
+static bool client_match(struct driver_data *data, void *msg, int len, u32 *pid)
+{
+	struct bridge_filter *filter;
+	bool match;
 
-	pr_debug("rpmsg_netlink: (src: 0x%x) %s\n", src, (char *)data);
+	rcu_read_lock();
+	spin_lock(&data->client_lock);
+	*pid = data->client_pid;
+	filter = rcu_dereference(data->client_filter);
+	spin_unlock(&data->client_lock);
+	match = !*pid || bridge_filter_match(filter, msg, len);
+	rcu_read_unlock();
 
-	drv_data = dev_get_drvdata(&rpdev->dev);
+	return match;
+}
 
-	// Guardar el mensaje en el buffer
-	msg_len = len;
-	if (msg_len > BUFFER_SIZE - 1) {
-		msg_len = BUFFER_SIZE - 1;
+/**
+ * @brief Deliver a message from the remote to userspace, runs in the rx worker
+ * @param rx Rx path of the device
+ * @param data Data received
+ * @param len Size of the data
+ */
+static void rx_deliver(struct bridge_rx *rx, void *data, int len)
+{
+	struct driver_data *drv_data = container_of(rx, struct driver_data, rx);
+	struct bridge_wire_hdr *hdr;
+	bool delivered = false;
+	bool dropped = false;
+	bool monitored;
+	bool match;
+	u32 pid;
+	int ret;
+
+	if (frag && bridge_frag_rx(&drv_data->frag, &data, &len)) {
+		return;
+	}
+	if (wire) {
+		// los mensajes de control son para el kernel, no para los clientes
+		hdr = bridge_wire_rx(&drv_data->wire, &data, &len);
+		if (!hdr || hdr->type != BRIDGE_WIRE_DATA) {
+			return;
+		}
+		pr_debug("rpmsg_netlink: seq %u, %d bytes\n", le32_to_cpu(hdr->seq), len);
+	}
+	if (credits) {
+		bridge_credit_rx(&drv_data->credit);
 	}
-	memcpy(msg_buffer, data, msg_len);
-	msg_buffer[msg_len] = '\0'; // Asegurarse de que termine en null
 
-	// Enviar a userspace por Netlink si hay un usuario conectado
-	if (drv_data->client_pid > 0) {
-		send_msg_to_userspace(data, len, drv_data->nl_sk, drv_data->client_pid);
+	// Encolar el mensaje para los lectores del dispositivo de caracter, los
+	// creditos de la cola vuelven a medida que se lee. El anillo mapeado no
+	// tiene control de flujo: el mensaje cuenta como tomado al escribirlo y
+	// se pierde si el anillo esta lleno
+	if (bridge_mmap_mapped(&drv_data->rx_ring)) {
+		ret = bridge_mmap_push(&drv_data->rx_ring, data, len);
+		delivered = !ret;
+		dropped = ret != 0;
 	} else {
+		bridge_msgq_push(&drv_data->rx_queue, data, len);
+	}
+
+	// Enviar a los monitores del grupo rx y al usuario conectado
+	monitored = bridge_genl_has_subscribers(&nl_family);
+	if (monitored) {
+		// -ESRCH: el ultimo monitor se acaba de ir
+		ret = send_msg_to_userspace(drv_data, data, len, 0);
+		delivered |= !ret;
+		dropped |= ret && ret != -ESRCH;
+	}
+	// el filtro del usuario descarta el mensaje antes de armar el skb
+	match = client_match(drv_data, data, len, &pid);
+	if (pid && match) {
+		ret = send_msg_to_userspace(drv_data, data, len, pid);
+		delivered |= !ret;
+		dropped |= ret != 0;
+	} else if (pid) {
+		// descartado por el usuario, como si lo hubiera leido
+		drv_data->filtered++;
+		delivered = true;
+	} else if (!monitored && credits) {
+		// el mensaje espera en el log a los lectores, que devuelven sus creditos
+		pr_debug("rpmsg_netlink: No user connected\n");
+	} else if (!monitored) {
 		pr_err("rpmsg_netlink: No user connected\n");
 	}
 
+	// un consumidor con lugar se llevo el mensaje y todos los anteriores, uno
+	// sin lugar lo pierde en vez de frenar al remoto para siempre
+	if (credits && dropped) {
+		bridge_credit_drop(&drv_data->credit);
+	} else if (credits && delivered) {
+		bridge_credit_consume_all(&drv_data->credit);
+	}
+}
+
+static int stats_show(struct seq_file *s, void *unused)
+{
+	struct driver_data *data = s->private;
+
+	seq_printf(s, "channel:      %d\n", data->id);
+	bridge_rx_show(s, &data->rx);
+	seq_printf(s, "nl_filtered:  %llu\n", data->filtered);
+	bridge_msgq_show(s, &data->rx_queue);
+	bridge_mmap_show(s, &data->rx_ring);
+	if (tx_queue) {
+		bridge_tx_show(s, &data->tx);
+	}
+	if (frag) {
+		bridge_frag_show(s, &data->frag);
+	}
+	if (credits) {
+		bridge_credit_show(s, &data->credit);
+	}
+	if (wire) {
+		bridge_wire_show(s, &data->wire);
+	}
+
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static const struct genl_ops nl_ops[] = {
+	{
+		.cmd = BRIDGE_CMD_SEND,
+		.doit = genl_send_doit,
+	},
+	{
+		.cmd = BRIDGE_CMD_STATS,
+		.doit = genl_stats_doit,
+	},
+	{
+		.cmd = BRIDGE_CMD_SUBSCRIBE,
+		.doit = genl_subscribe_doit,
+	},
+};
 
-struct netlink_kernel_cfg cfg = {
-	.input = netlink_recv_cb,
+static struct genl_family nl_family = {
+	.name = GENL_NAME,
+	.version = BRIDGE_GENL_VERSION,
+	.maxattr = BRIDGE_ATTR_MAX,
+	.policy = bridge_genl_policy,
+	.parallel_ops = true, /* channels are looked up under SRCU */
+	.ops = nl_ops,
+	.n_ops = ARRAY_SIZE(nl_ops),
+	.mcgrps = bridge_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(bridge_genl_mcgrps),
+	.module = THIS_MODULE,
 };
 
+static void driver_data_put(void *data)
+{
+	struct driver_data *drv_data = data;
+
+	kref_put(&drv_data->ref, driver_data_release);
+}
+
+/**
+ * @brief Allocate a channel or endpoint and reserve its id
+ * @param parent Channel of an endpoint, NULL for a channel
+ * @return Instance or ERR_PTR()
+ */
+static struct driver_data *instance_alloc(struct driver_data *parent)
+{
+	struct driver_data *data;
+
+	// open files may outlive the instance
+	data = kzalloc(sizeof(struct driver_data), GFP_KERNEL);
+	if (!data) {
+		pr_err("rpmsg_netlink: Error allocating memory.\n");
+		return ERR_PTR(-ENOMEM);
+	}
+	kref_init(&data->ref);
+	spin_lock_init(&data->client_lock);
+	mutex_init(&data->ept_lock);
+	INIT_LIST_HEAD(&data->epts);
+	INIT_LIST_HEAD(&data->node);
+
+	data->id = bridge_chan_alloc(&chans);
+	if (data->id < 0) {
+		pr_err("rpmsg_netlink: Too many channels.\n");
+		kfree(data);
+		return ERR_PTR(-ENOSPC);
+	}
+
+	if (parent) {
+		kref_get(&parent->ref);
+		data->parent = parent;
+	}
+
+	return data;
+}
+
+/**
+ * @brief Drop an instance that was never started
+ * @param data Instance
+ */
+static void instance_drop(struct driver_data *data)
+{
+	bridge_chan_free(&chans, data->id);
+	kref_put(&data->ref, driver_data_release);
+}
+
+static void instance_del_chardev(struct driver_data *data)
+{
+	device_destroy(rpmsg_class, MKDEV(MAJOR(dev_num), data->id));
+	cdev_del(data->cdev);
+}
+
+/**
+ * @brief Set up the queues, char device and tx/rx paths of an instance
+ * @param data Instance, with ept and dst set
+ * @param rpdev Channel of the instance
+ * @param dbg_name Name of its debugfs directory
+ * @return 0 or error
+ */
+static int instance_start(struct driver_data *data, struct rpmsg_device *rpdev,
+			  const char *dbg_name)
+{
+	dev_t devt = MKDEV(MAJOR(dev_num), data->id);
+	char name[TASK_COMM_LEN];
+	struct device *dev;
+	int ret;
+
+	ret = bridge_msgq_init(&data->rx_queue, queue_len);
+	if (!ret && mmap_slots) {
+		ret = bridge_mmap_init(&data->rx_ring, mmap_slots, mmap_slot_size);
+	}
+	if (ret) {
+		pr_err("rpmsg_netlink: Error allocating read queues.\n");
+		return ret;
+	}
+
+	// Agregar el dispositivo de caracter, se libera con el ultimo archivo que lo usa
+	data->cdev = cdev_alloc();
+	if (!data->cdev) {
+		pr_err("rpmsg_char_dev: No se pudo agregar el dispositivo\n");
+		return -ENOMEM;
+	}
+	data->cdev->ops = &fops;
+	data->cdev->owner = THIS_MODULE;
+	ret = cdev_add(data->cdev, devt, 1);
+	if (ret < 0) {
+		kobject_put(&data->cdev->kobj);
+		pr_err("rpmsg_char_dev: No se pudo agregar el dispositivo\n");
+		return ret;
+	}
+
+	if (data->id) {
+		data->chardev = device_create(rpmsg_class, &rpdev->dev, devt, NULL, "%s%d",
+					      DEVICE_NAME, data->id);
+	} else {
+		data->chardev = device_create(rpmsg_class, &rpdev->dev, devt, NULL, DEVICE_NAME);
+	}
+	if (IS_ERR(data->chardev)) {
+		cdev_del(data->cdev);
+		pr_err("rpmsg_char_dev: No se pudo crear el dispositivo\n");
+		return PTR_ERR(data->chardev);
+	}
+
+	// the buffers of a channel outlive late callbacks until the rpmsg core
+	// destroys its endpoint, those of an endpoint go away with its node
+	dev = data->parent ? data->chardev : &rpdev->dev;
+
+	if (frag) {
+		ret = bridge_frag_init(&data->frag, dev, frag_max, frag_timeout_ms);
+		if (ret) {
+			pr_err("rpmsg_netlink: Error allocating reassembly buffers.\n");
+			instance_del_chardev(data);
+			return ret;
+		}
+	}
+
+	if (tx_queue) {
+		ret = bridge_tx_init(&data->tx, dev, data->ept, data->dst, frag ? &data->frag : NULL,
+				     tx_queue, tx_coalesce_us);
+		if (ret) {
+			pr_err("rpmsg_netlink: Error allocating tx queue.\n");
+			instance_del_chardev(data);
+			return ret;
+		}
+	}
+
+	// deliver to userspace off the rpmsg callback
+	snprintf(name, sizeof(name), "kws_rx/%d", data->id);
+	ret = bridge_rx_init(&data->rx, dev, name, rx_slots, rpmsg_get_mtu(data->ept), rx_prio,
+			     rx_deliver);
+	if (ret) {
+		pr_err("rpmsg_netlink: Error starting rx worker.\n");
+		instance_del_chardev(data);
+		return ret;
+	}
+
+	if (credits) {
+		bridge_credit_init(&data->credit, min3(credits, rx_slots, queue_len), credit_send);
+		data->rx_queue.consumed = credit_read;
+	}
+
+	data->dbg = debugfs_create_dir(dbg_name, dbg_root);
+	debugfs_create_file("stats", 0444, data->dbg, data, &stats_fops);
+
+	return 0;
+}
+
+/**
+ * @brief Make an instance reachable from callbacks, netlink and its node
+ * @param data Instance
+ * @param rpdev Channel of the instance
+ */
+static void instance_publish(struct driver_data *data, struct rpmsg_device *rpdev)
+{
+	smp_store_release(&data->started, true);
+	rcu_assign_pointer(data->rpdev, rpdev);
+	bridge_chan_publish(&chans, data->id, data);
+	bridge_genl_notify(&nl_family, BRIDGE_CMD_CHANNEL_NEW, data->id);
+}
+
+/**
+ * @brief Hide an instance from userspace and tear it down
+ * @param data Instance
+ *
+ * The endpoints of a channel are destroyed first. Open files keep data
+ * until they are closed. The endpoint of a channel outlives remove, its
+ * callbacks are fenced when the rx path is destroyed.
+ */
+static void instance_stop(struct driver_data *data)
+{
+	struct driver_data *ept;
+
+	// callbacks from now on drop their message instead of queueing it
+	WRITE_ONCE(data->started, false);
+	// wait for senders still using the instance, no endpoint is created after this
+	RCU_INIT_POINTER(data->rpdev, NULL);
+	bridge_chan_del(&chans, data->id);
+	bridge_genl_notify(&nl_family, BRIDGE_CMD_CHANNEL_DEL, data->id);
+
+	mutex_lock(&data->ept_lock);
+	while ((ept = list_first_entry_or_null(&data->epts, struct driver_data, node))) {
+		list_del_init(&ept->node);
+		mutex_unlock(&data->ept_lock);
+		instance_stop(ept);
+		kref_put(&ept->ref, driver_data_release);
+		mutex_lock(&data->ept_lock);
+	}
+	mutex_unlock(&data->ept_lock);
+
+	debugfs_remove_recursive(data->dbg);
+	if (credits) {
+		bridge_credit_destroy(&data->credit);
+	}
+	if (tx_queue) {
+		bridge_tx_destroy(&data->tx);
+	}
+	if (data->parent) {
+		// no callback runs after this
+		rpmsg_destroy_ept(data->ept);
+	}
+	// the endpoint of a channel is only destroyed by the rpmsg core after remove
+	bridge_rx_destroy(&data->rx, data->parent ? NULL : data->ept);
+	bridge_filter_swap(&data->client_filter, NULL);
+
+	instance_del_chardev(data);
+	bridge_chan_free(&chans, data->id);
+}
+
+/**
+ * @brief Create an endpoint on a channel, within its SRCU read section
+ * @param parent Channel
+ * @param rpdev Device of the channel
+ * @param info Request from userspace, src and id are filled in
+ * @return 0 or error
+ */
+static int ept_start(struct driver_data *parent, struct rpmsg_device *rpdev,
+		     struct bridge_ept_info *info)
+{
+	struct rpmsg_channel_info chinfo = {};
+	char dbg_name[RPMSG_NAME_SIZE + 16];
+	struct driver_data *data;
+	int ret;
+
+	data = instance_alloc(parent);
+	if (IS_ERR(data)) {
+		return PTR_ERR(data);
+	}
+
+	strscpy(chinfo.name, info->name, sizeof(chinfo.name));
+	chinfo.src = info->src;
+	chinfo.dst = RPMSG_ADDR_ANY;
+	data->ept = rpmsg_create_ept(rpdev, rpmsg_recv_cb, data, chinfo);
+	if (!data->ept) {
+		pr_err("rpmsg_netlink: Error creating endpoint %s.\n", chinfo.name);
+		instance_drop(data);
+		return -EINVAL;
+	}
+	data->dst = info->dst == BRIDGE_ADDR_ANY ? rpdev->dst : info->dst;
+
+	snprintf(dbg_name, sizeof(dbg_name), "%s.%d", chinfo.name, data->id);
+	ret = instance_start(data, rpdev, dbg_name);
+	if (ret) {
+		rpmsg_destroy_ept(data->ept);
+		instance_drop(data);
+		return ret;
+	}
+
+	mutex_lock(&parent->ept_lock);
+	list_add_tail(&data->node, &parent->epts);
+	mutex_unlock(&parent->ept_lock);
+
+	instance_publish(data, rpdev);
+	if (wire) {
+		// the remote learns the address of the endpoint from it
+		send_wire(data, BRIDGE_WIRE_HELLO, NULL, 0, false);
+	}
+	if (credits) {
+		bridge_credit_start(&data->credit);
+	}
+
+	info->src = data->ept->addr;
+	info->id = data->id;
+	pr_info("rpmsg_netlink: New endpoint %s 0x%x -> 0x%x (channel %d)\n", chinfo.name,
+		info->src, data->dst, data->id);
+
+	return 0;
+}
+
+/**
+ * @brief BRIDGE_IOC_CREATE_EPT, crear un endpoint sobre el canal
+ * @param parent Canal del archivo
+ * @param arg Puntero a struct bridge_ept_info
+ * @return 0 o error
+ */
+static int ept_create(struct driver_data *parent, void __user *arg)
+{
+	struct bridge_ept_info info;
+	struct rpmsg_device *rpdev;
+	int idx, ret;
+
+	// los endpoints se crean sobre un canal
+	if (parent->parent) {
+		return -EINVAL;
+	}
+
+	if (copy_from_user(&info, arg, sizeof(info))) {
+		return -EFAULT;
+	}
+	info.name[sizeof(info.name) - 1] = '\0';
+
+	idx = srcu_read_lock(&chans.srcu);
+	rpdev = srcu_dereference(parent->rpdev, &chans.srcu);
+	ret = rpdev ? ept_start(parent, rpdev, &info) : -ENODEV;
+	srcu_read_unlock(&chans.srcu, idx);
+
+	if (!ret && copy_to_user(arg, &info, sizeof(info))) {
+		// el endpoint queda creado, se puede buscar por nombre en debugfs
+		ret = -EFAULT;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief BRIDGE_IOC_DESTROY_EPT, destruir el endpoint del archivo
+ * @param data Endpoint del archivo
+ * @return 0 o error
+ */
+static int ept_destroy(struct driver_data *data)
+{
+	struct driver_data *parent = data->parent;
+	bool found;
+
+	// los canales se eliminan con su dispositivo rpmsg
+	if (!parent) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&parent->ept_lock);
+	found = !list_empty(&data->node);
+	list_del_init(&data->node);
+	mutex_unlock(&parent->ept_lock);
+	if (!found) {
+		return -ENODEV;
+	}
+
+	instance_stop(data);
+	kref_put(&data->ref, driver_data_release);
+
+	return 0;
+}
+
 /**
  * @brief Probe function for the rpmsg device
  * @param rpdev Remote processor device
@@ -223,33 +1246,43 @@ struct netlink_kernel_cfg cfg = {
 static int rpmsg_netlink_probe(struct rpmsg_device *rpdev)
 {
 	struct driver_data *data;
-	char empty_msg[] = "";
+	int ret;
 
-	// save rpmsg device
-	rpmsg_dev = rpdev;
 	pr_info("rpmsg_netlink: New channel (src) 0x%x -> (dst) 0x%x\n", rpdev->src, rpdev->dst);
 
 	pr_info("rpmsg_netlink: mtu %ld\n", rpmsg_get_mtu(rpdev->ept));
 
-	// allocate memory for the device data
-	data = devm_kzalloc(&rpdev->dev, sizeof(struct driver_data), GFP_KERNEL);
-	if (!data) {
-		pr_err("rpmsg_netlink: Error allocating memory.\n");
-		return -ENOMEM;
+	data = instance_alloc(NULL);
+	if (IS_ERR(data)) {
+		return PTR_ERR(data);
 	}
+	data->ept = rpdev->ept;
+	data->dst = rpdev->dst;
 
-	// create netlink socket
-	data->nl_sk = netlink_kernel_create(&init_net, NETLINK_USER, &cfg);
-	if (!data->nl_sk) {
-		pr_err("rpmsg_netlink: Error creating socket.\n");
-		return -10;
+	ret = instance_start(data, rpdev, dev_name(&rpdev->dev));
+	if (ret) {
+		instance_drop(data);
+		return ret;
 	}
 
-	// save netlink socket
 	dev_set_drvdata(&rpdev->dev, data);
 
+	// late callbacks still find data, the reference is dropped once the
+	// rpmsg core destroyed the endpoint of the channel
+	ret = devm_add_action(&rpdev->dev, driver_data_put, data);
+	if (ret) {
+		instance_stop(data);
+		kref_put(&data->ref, driver_data_release);
+		return ret;
+	}
+
+	instance_publish(data, rpdev);
+
 	// send first sync message to complete ept creation
-	send_rpmsg(rpmsg_dev, empty_msg, sizeof(empty_msg));
+	send_wire(data, BRIDGE_WIRE_HELLO, NULL, 0, false);
+	if (credits) {
+		bridge_credit_start(&data->credit);
+	}
 
 	return 0;
 }
@@ -261,7 +1294,8 @@ static int rpmsg_netlink_probe(struct rpmsg_device *rpdev)
 static void rpmsg_netlink_remove(struct rpmsg_device *rpdev)
 {
 	struct driver_data *drv_data = dev_get_drvdata(&rpdev->dev);
-	netlink_kernel_release(drv_data->nl_sk);
+
+	instance_stop(drv_data);
 }
 
 static struct rpmsg_device_id rpmsg_driver_id_table[] = {
@@ -286,44 +1320,52 @@ static int __init rpmsg_netlink_init(void)
 
 	pr_info("rpmsg_netlink: Iniciando el módulo\n");
 
-	// Asignar un numero mayor y menor para el dispositivo
-	ret = alloc_chrdev_region(&dev_num, 0, 1, DEVICE_NAME);
+	ret = bridge_chan_table_init(&chans);
+	if (ret) {
+		return ret;
+	}
+
+	// Una familia netlink para todos los canales
+	ret = genl_register_family(&nl_family);
+	if (ret) {
+		bridge_chan_table_destroy(&chans);
+		pr_err("rpmsg_netlink: Error registering the netlink family.\n");
+		return ret;
+	}
+
+	// Asignar un numero mayor y un menor por canal
+	ret = alloc_chrdev_region(&dev_num, 0, BRIDGE_MAX_CHANNELS, DEVICE_NAME);
 	if (ret < 0) {
+		genl_unregister_family(&nl_family);
+		bridge_chan_table_destroy(&chans);
 		pr_err("rpmsg_char_dev: No se pudo asignar el número de dispositivo\n");
 		return ret;
 	}
 
-	// Crear una clase para el dispositivo
+	// Crear una clase para los dispositivos
 	rpmsg_class = class_create(THIS_MODULE, CLASS_NAME);
 	if (IS_ERR(rpmsg_class)) {
-		unregister_chrdev_region(dev_num, 1);
+		unregister_chrdev_region(dev_num, BRIDGE_MAX_CHANNELS);
+		genl_unregister_family(&nl_family);
+		bridge_chan_table_destroy(&chans);
 		pr_err("rpmsg_char_dev: No se pudo crear la clase\n");
 		return PTR_ERR(rpmsg_class);
 	}
 
-	// Crear el dispositivo
-	rpmsg_device = device_create(rpmsg_class, NULL, dev_num, NULL, DEVICE_NAME);
-	if (IS_ERR(rpmsg_device)) {
-		class_destroy(rpmsg_class);
-		unregister_chrdev_region(dev_num, 1);
-		pr_err("rpmsg_char_dev: No se pudo crear el dispositivo\n");
-		return PTR_ERR(rpmsg_device);
-	}
+	dbg_root = debugfs_create_dir(DRIVER_NAME, NULL);
 
-	// Inicializar y agregar el dispositivo de caracter
-	cdev_init(&rpmsg_cdev, &fops);
-	ret = cdev_add(&rpmsg_cdev, dev_num, 1);
-	if (ret < 0) {
-		device_destroy(rpmsg_class, dev_num);
+	// Los dispositivos de caracter se crean al aparecer cada canal
+	ret = register_rpmsg_driver(&rpmsg_client);
+	if (ret) {
+		debugfs_remove_recursive(dbg_root);
 		class_destroy(rpmsg_class);
-		unregister_chrdev_region(dev_num, 1);
-		pr_err("rpmsg_char_dev: No se pudo agregar el dispositivo\n");
+		unregister_chrdev_region(dev_num, BRIDGE_MAX_CHANNELS);
+		genl_unregister_family(&nl_family);
+		bridge_chan_table_destroy(&chans);
 		return ret;
 	}
 
-	pr_info("rpmsg_char_dev: Dispositivo registrado correctamente\n");
-
-	return register_rpmsg_driver(&rpmsg_client);
+	return 0;
 }
 
 /**
@@ -331,13 +1373,16 @@ static int __init rpmsg_netlink_init(void)
  */
 static void __exit rpmsg_netlink_exit(void)
 {
-	// Eliminar el dispositivo de carácter
-	cdev_del(&rpmsg_cdev);
-	device_destroy(rpmsg_class, dev_num);
-	class_destroy(rpmsg_class);
-	unregister_chrdev_region(dev_num, 1);
-
+	// Eliminar los canales y sus dispositivos de caracter
 	unregister_rpmsg_driver(&rpmsg_client);
+
+	debugfs_remove_recursive(dbg_root);
+	class_destroy(rpmsg_class);
+	unregister_chrdev_region(dev_num, BRIDGE_MAX_CHANNELS);
+	genl_unregister_family(&nl_family);
+	bridge_chan_table_destroy(&chans);
+	// Esperar a que se liberen los filtros pendientes
+	rcu_barrier();
 	pr_info("rpmsg_netlink: Módulo cerrado\n");
 }
 
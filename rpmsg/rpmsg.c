@@ -14,100 +14,1216 @@
 #include <linux/module.h>
 #include <linux/rpmsg.h>
 #include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/list.h>
+#include <linux/io.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
-// #define RPMSG_ENDPOINT_NAME "rpmsg-nocopy"
 #define RPMSG_ENDPOINT_NAME "rpmsg-client-sample"
-#define MESSAGE_SIZE        496
-#define NUM_MESSAGES        10000
+#define RPMSG_NOCOPY_NAME   "rpmsg-nocopy"
+#define DRIVER_NAME         "rpmsg_bench"
+#define HIST_BUCKETS        64
+#define WATCHDOG_MS         1000
 
-static char msg[MESSAGE_SIZE];
-static ktime_t start_time = 0;
+static unsigned int msg_size = 496;
+module_param(msg_size, uint, 0444);
+MODULE_PARM_DESC(msg_size, "Payload size in bytes of each test message (max rpmsg mtu)");
 
+static unsigned int num_messages = 10000;
+module_param(num_messages, uint, 0444);
+MODULE_PARM_DESC(num_messages, "Number of measured round-trips");
+
+static unsigned int warmup = 100;
+module_param(warmup, uint, 0444);
+MODULE_PARM_DESC(warmup, "Number of round-trips sent before measuring starts");
+
+static unsigned int window = 1;
+module_param(window, uint, 0444);
+MODULE_PARM_DESC(window, "Messages kept in flight (1 = ping-pong, >1 = pipelined throughput)");
+
+static bool sweep;
+module_param(sweep, bool, 0444);
+MODULE_PARM_DESC(sweep, "Repeat the test for every power of two payload size up to the mtu "
+		 "(sizes without room for a sequence number run in ping-pong)");
+
+static unsigned int num_endpoints = 1;
+module_param(num_endpoints, uint, 0444);
+MODULE_PARM_DESC(num_endpoints, "Endpoints per channel running the test concurrently");
+
+static bool tx_worker;
+module_param(tx_worker, bool, 0444);
+MODULE_PARM_DESC(tx_worker, "Send from a dedicated worker instead of the rx callback, so the "
+			    "callback only does the accounting");
+
+static struct dentry *bench_debugfs;
+static struct workqueue_struct *bench_wq;
+static LIST_HEAD(bench_instances);
+static DEFINE_MUTEX(bench_instances_lock);
+
+enum bench_mode {
+	BENCH_MODE_COPY,
+	BENCH_MODE_NOCOPY,
+};
+
+static const char *const bench_mode_names[] = {
+	[BENCH_MODE_COPY] = "copy",
+	[BENCH_MODE_NOCOPY] = "nocopy",
+};
+
+/* every test message starts with this header when msg_size allows it */
+struct bench_hdr {
+	__le32 seq;
+};
+
+/*
+ * nocopy mode: the payload stays in a shared buffer region and only this
+ * descriptor crosses rpmsg, the remote echoes it back.
+ */
+struct bench_desc {
+	__le32 seq;
+	__le32 offset;
+	__le32 len;
+};
+
+/* nocopy mode: tells the remote where the shared region is */
+struct bench_shm_info {
+	char cmd[8];
+	__le64 addr;
+	__le32 size;
+	__le32 slot_size;
+};
+
+enum bench_slot_state {
+	SLOT_FREE,
+	SLOT_IN_FLIGHT,
+	SLOT_LOST,
+	SLOT_ACKED,
+};
+
+struct bench_slot {
+	u32 seq;
+	enum bench_slot_state state;
+	ktime_t tx_time;
+};
+
+/* one line of the sweep table */
+struct bench_sweep_row {
+	unsigned int size;
+	unsigned int messages;
+	u64 lost;
+	s64 elapsed_ns;
+	u64 msg_per_s;
+	u64 kb_per_s;
+	u64 min_ns;
+	u64 avg_ns;
+	u64 p50_ns;
+	u64 p99_ns;
+	u64 max_ns;
+};
+
+#define BENCH_TX_BUSY 0
+
+/* one test instance per endpoint */
 struct instance_data {
-	int rx_count;
+	struct rpmsg_device *rpdev;
+	struct rpmsg_endpoint *ept;
+	unsigned int index;
+	struct list_head node;
+	enum bench_mode mode;
+	char *msg;
+	char *shm;
+	size_t shm_size;
+	unsigned int slot_size;
+	unsigned int msg_size;
+	unsigned int window;
+	bool seqhdr;
+	bool done;
+	bool stopping; /* under lock, no run is started or step scheduled once set */
+	unsigned long flags;
+
+	/* sweep mode */
+	struct bench_sweep_row *rows;
+	unsigned int nrows;
+	unsigned int step;
+	struct work_struct step_work;
+
+	spinlock_t lock; /* protects the counters and slots below */
+	u32 total;
+	u32 tx_seq;
+	u32 in_flight;
+	u32 rx_expected;
+	struct bench_slot *slots;
+	unsigned int nslots;
+
+	/* counters */
+	u64 rx_count;
+	u64 rx_bytes;
+	u64 lost;
+	u64 reordered;
+	u64 duplicates;
+	u64 tx_stalls;
+	u64 tx_stall_ns;
+	u64 tx_errors;
+
+	/* timing, all in ns */
+	ktime_t start_time;
+	ktime_t end_time;
+	u64 *samples;
+	unsigned int nsamples;
+	bool sorted;
+	u64 hist[HIST_BUCKETS];
+	u64 lat_min;
+	u64 lat_max;
+	u64 lat_sum;
+
+	struct work_struct tx_work;
+	struct delayed_work watchdog;
+	u64 watchdog_rx;
+
+	struct mutex stats_lock; /* protects sorting of samples */
+	struct dentry *dbg;
 };
 
-static int rpmsg_sample_cb(struct rpmsg_device *rpdev, void *data, int len, void *priv, u32 src)
+struct bench_channel {
+	struct rpmsg_device *rpdev;
+	unsigned int ninstances;
+	struct instance_data *instances[];
+};
+
+/**
+ * @brief Record one round-trip latency
+ * @param idata Instance data
+ * @param lat Latency in ns
+ */
+static void bench_record(struct instance_data *idata, u64 lat)
+{
+	int bucket = lat ? fls64(lat) - 1 : 0;
+
+	idata->samples[idata->nsamples++] = lat;
+	idata->hist[bucket]++;
+	idata->lat_sum += lat;
+	if (lat < idata->lat_min)
+		idata->lat_min = lat;
+	if (lat > idata->lat_max)
+		idata->lat_max = lat;
+}
+
+/**
+ * @brief Print the results of a finished run
+ * @param idata Instance data
+ */
+static void bench_report(struct instance_data *idata)
 {
+	s64 elapsed = ktime_to_ns(ktime_sub(idata->end_time, idata->start_time));
+
+	printk("\n--------- TEST RESULTS ---------------\n");
+	printk("mode: %s, endpoint 0x%x\n", bench_mode_names[idata->mode], idata->ept->addr);
+	printk("messages: %u (+%u warmup), window %u\n", num_messages, warmup, idata->window);
+	printk("message size: %u\n", idata->msg_size);
+	printk("elapsed time: %lld us\n", elapsed / 1000);
+	if (idata->nsamples) {
+		printk("latency min/avg/max: %llu/%llu/%llu ns\n", idata->lat_min,
+		       div_u64(idata->lat_sum, idata->nsamples), idata->lat_max);
+	}
+	if (elapsed > 0) {
+		printk("throughput: %llu msg/s, %llu KB/s\n",
+		       div64_u64((u64)idata->nsamples * NSEC_PER_SEC, elapsed),
+		       div64_u64(idata->rx_bytes * (NSEC_PER_SEC / 1000), elapsed));
+	}
+	printk("lost: %llu reordered: %llu duplicates: %llu tx stalls: %llu (%llu us)\n",
+	       idata->lost, idata->reordered, idata->duplicates, idata->tx_stalls,
+	       idata->tx_stall_ns / 1000);
+}
+
+/**
+ * @brief Wrap up a finished run, in sweep mode move on to the next size
+ * @param idata Instance data
+ */
+static void bench_finish(struct instance_data *idata)
+{
+	unsigned long flags;
+
+	if (sweep) {
+		/* sorting the samples does not belong in the rx callback */
+		spin_lock_irqsave(&idata->lock, flags);
+		if (!idata->stopping) {
+			schedule_work(&idata->step_work);
+		}
+		spin_unlock_irqrestore(&idata->lock, flags);
+		return;
+	}
+
+	bench_report(idata);
+	rpmsg_send(idata->ept, "end", 4);
+}
+
+/**
+ * @brief Keep the window full
+ * @param idata Instance data
+ * @param can_block Use blocking sends, only from process context
+ *
+ * Only one sender runs at a time so the message template can be stamped
+ * with the sequence number in place. Every send first tries to get a tx
+ * buffer without waiting, running out of them is counted as a stall. In
+ * non-blocking mode the rest of the window is then handed to tx_work,
+ * otherwise the send waits for a buffer and the wait time is accounted.
+ *
+ * In nocopy mode the payload of each slot already lives in the shared
+ * region, only its sequence number is stamped before the descriptor is sent.
+ */
+static void bench_tx(struct instance_data *idata, bool can_block)
+{
+	struct bench_hdr *hdr = (struct bench_hdr *)idata->msg;
+	struct bench_desc desc;
+	struct bench_slot *slot;
+	unsigned long flags;
+	bool stalled = false;
+	bool more;
+	ktime_t t0;
+	void *buf;
+	int len;
+	u32 seq;
 	int ret;
-	s64 elapsed;
-	ktime_t end_time;
-	struct instance_data *idata = dev_get_drvdata(&rpdev->dev);
 
-	++idata->rx_count;
+again:
+	if (test_and_set_bit(BENCH_TX_BUSY, &idata->flags)) {
+		return;
+	}
+
+	for (;;) {
+		spin_lock_irqsave(&idata->lock, flags);
+		if (idata->done || idata->tx_seq >= idata->total ||
+		    idata->in_flight >= idata->window) {
+			spin_unlock_irqrestore(&idata->lock, flags);
+			break;
+		}
+		seq = idata->tx_seq++;
+		idata->in_flight++;
+		slot = &idata->slots[seq & (idata->nslots - 1)];
+		slot->seq = seq;
+		slot->state = SLOT_IN_FLIGHT;
+		slot->tx_time = ktime_get();
+		/* measurement starts with the first message after the warmup */
+		if (seq == warmup) {
+			idata->start_time = slot->tx_time;
+		}
+		spin_unlock_irqrestore(&idata->lock, flags);
+
+		if (idata->mode == BENCH_MODE_NOCOPY) {
+			desc.seq = cpu_to_le32(seq);
+			desc.offset = cpu_to_le32((seq & (idata->nslots - 1)) * idata->slot_size);
+			desc.len = cpu_to_le32(idata->msg_size);
+			hdr = (struct bench_hdr *)(idata->shm + le32_to_cpu(desc.offset));
+			buf = &desc;
+			len = sizeof(desc);
+		} else {
+			buf = idata->msg;
+			len = idata->msg_size;
+		}
+
+		if (idata->seqhdr) {
+			hdr->seq = cpu_to_le32(seq);
+		}
+
+		ret = rpmsg_trysend(idata->ept, buf, len);
+		if (ret == -ENOMEM) {
+			spin_lock_irqsave(&idata->lock, flags);
+			idata->tx_stalls++;
+			spin_unlock_irqrestore(&idata->lock, flags);
+
+			if (can_block) {
+				t0 = ktime_get();
+				ret = rpmsg_send(idata->ept, buf, len);
+				spin_lock_irqsave(&idata->lock, flags);
+				idata->tx_stall_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+				spin_unlock_irqrestore(&idata->lock, flags);
+			}
+		}
+
+		if (ret) {
+			/* nothing left the building, give the sequence number back */
+			spin_lock_irqsave(&idata->lock, flags);
+			idata->tx_seq--;
+			idata->in_flight--;
+			slot->state = SLOT_FREE;
+			if (ret != -ENOMEM) {
+				/* the link is gone, no point in waiting for the watchdog */
+				idata->tx_errors++;
+				idata->end_time = ktime_get();
+				idata->done = true;
+			}
+			spin_unlock_irqrestore(&idata->lock, flags);
+
+			if (ret != -ENOMEM) {
+				dev_err(&idata->rpdev->dev, "rpmsg_send failed: %d\n", ret);
+			}
+			stalled = true;
+			break;
+		}
+	}
+
+	clear_bit(BENCH_TX_BUSY, &idata->flags);
+
+	if (stalled) {
+		spin_lock_irqsave(&idata->lock, flags);
+		if (!can_block && !idata->done) {
+			queue_work(bench_wq, &idata->tx_work);
+		}
+		spin_unlock_irqrestore(&idata->lock, flags);
+		return;
+	}
+
+	/* a reply may have opened the window while we held the busy bit */
+	spin_lock_irqsave(&idata->lock, flags);
+	more = !idata->done && idata->tx_seq < idata->total && idata->in_flight < idata->window;
+	spin_unlock_irqrestore(&idata->lock, flags);
+	if (more) {
+		goto again;
+	}
+}
+
+static void bench_tx_work(struct work_struct *work)
+{
+	struct instance_data *idata = container_of(work, struct instance_data, tx_work);
+
+	bench_tx(idata, true);
+}
+
+/**
+ * @brief Finish the run if no reply arrived during the last period
+ *
+ * Messages lost at the tail of a run never produce a sequence gap, so they
+ * are only accounted for here. The run also ends when not everything was
+ * sent yet: a remote that stopped answering leaves the sender throttled by
+ * the window or blocked for a buffer, and would hang the run otherwise.
+ * Everything sent and not answered is lost then.
+ */
+static void bench_watchdog(struct work_struct *work)
+{
+	struct instance_data *idata =
+		container_of(to_delayed_work(work), struct instance_data, watchdog);
+	unsigned long flags;
+	bool finished = false;
+
+	spin_lock_irqsave(&idata->lock, flags);
+	if (!idata->done && idata->rx_count == idata->watchdog_rx) {
+		/* with the messages already declared lost, tx_seq - rx_count in total */
+		idata->lost += idata->in_flight;
+		idata->in_flight = 0;
+		idata->end_time = ktime_get();
+		if (idata->tx_seq <= warmup) {
+			/* stopped before anything was measured */
+			idata->start_time = idata->end_time;
+		}
+		idata->done = true;
+		finished = true;
+	}
+	idata->watchdog_rx = idata->rx_count;
+	spin_unlock_irqrestore(&idata->lock, flags);
+
+	if (finished) {
+		dev_warn(&idata->rpdev->dev, "no reply in %d ms, finishing run\n", WATCHDOG_MS);
+		bench_finish(idata);
+	} else if (!idata->done) {
+		schedule_delayed_work(&idata->watchdog, msecs_to_jiffies(WATCHDOG_MS));
+	}
+}
+
+/**
+ * @brief Check a reply and extract its sequence number
+ * @param idata Instance data
+ * @param data Data received
+ * @param len Size of the data
+ * @param seq Sequence number, U32_MAX when the reply carries none
+ * @return 0 or -EINVAL if the reply is corrupt
+ */
+static int bench_parse(struct instance_data *idata, void *data, int len, u32 *seq)
+{
+	unsigned int off = idata->seqhdr ? sizeof(struct bench_hdr) : 0;
+	unsigned int msg_size = idata->msg_size;
+	struct bench_desc *desc = data;
+	u32 offset;
+
+	*seq = U32_MAX;
+
+	if (idata->mode == BENCH_MODE_COPY) {
+		if (msg_size != len || memcmp(data + off, idata->msg + off, msg_size - off)) {
+			pr_err("data: %s\n", (char *)data);
+			pr_err("expected %u bytes, received %d bytes\n", msg_size, len);
+			return -EINVAL;
+		}
+		if (idata->seqhdr) {
+			*seq = le32_to_cpu(((struct bench_hdr *)data)->seq);
+		}
+		return 0;
+	}
+
+	if (len != sizeof(*desc)) {
+		pr_err("expected %zu byte descriptor, received %d bytes\n", sizeof(*desc), len);
+		return -EINVAL;
+	}
+
+	*seq = le32_to_cpu(desc->seq);
+	offset = le32_to_cpu(desc->offset);
+	if (le32_to_cpu(desc->len) != msg_size ||
+	    offset != (*seq & (idata->nslots - 1)) * idata->slot_size) {
+		pr_err("bad descriptor: seq %u offset %u len %u\n", *seq, offset,
+		       le32_to_cpu(desc->len));
+		return -EINVAL;
+	}
+
+	/* read the payload back from the shared region, like a real consumer */
+	data = idata->shm + offset;
+	if ((idata->seqhdr && le32_to_cpu(((struct bench_hdr *)data)->seq) != *seq) ||
+	    memcmp(data + off, idata->msg + off, msg_size - off)) {
+		pr_err("shared buffer at offset %u does not match seq %u\n", offset, *seq);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int rpmsg_sample_cb(struct rpmsg_device *rpdev, void *data, int len, void *priv, u32 src)
+{
+	ktime_t now = ktime_get();
+	struct instance_data *idata = priv;
+	struct bench_slot *slot;
+	unsigned long flags;
+	bool finished = false;
+	u32 seq;
+
+	/* the channel may deliver before probe has set up its instance */
+	if (!idata) {
+		return 0;
+	}
+
+	spin_lock_irqsave(&idata->lock, flags);
+
+	if (idata->done) {
+		spin_unlock_irqrestore(&idata->lock, flags);
+		return 0;
+	}
 
 	// check received data
-	if (MESSAGE_SIZE != len || memcmp(data, msg, MESSAGE_SIZE)) {
+	if (bench_parse(idata, data, len, &seq)) {
+		spin_unlock_irqrestore(&idata->lock, flags);
 		dev_err(&rpdev->dev, "data integrity check failed\n");
-		pr_err("data: %s\n", (char *)data);
-		pr_err("expected %d bytes, received %d bytes\n", MESSAGE_SIZE, len);
 		return -EINVAL;
 	}
 
+	/* without a sequence number only ping-pong is allowed, so replies come in order */
+	if (seq == U32_MAX) {
+		seq = idata->rx_expected;
+	}
+	slot = &idata->slots[seq & (idata->nslots - 1)];
+
+	if (seq >= idata->tx_seq || slot->seq != seq || slot->state == SLOT_ACKED ||
+	    slot->state == SLOT_FREE) {
+		idata->duplicates++;
+		spin_unlock_irqrestore(&idata->lock, flags);
+		return 0;
+	}
+
+	if (slot->state == SLOT_LOST) {
+		/* declared lost when a later message overtook it */
+		idata->lost--;
+		idata->reordered++;
+	} else {
+		idata->in_flight--;
+		/* everything skipped over is lost until it shows up */
+		for (; idata->rx_expected < seq; idata->rx_expected++) {
+			struct bench_slot *gap =
+				&idata->slots[idata->rx_expected & (idata->nslots - 1)];
+
+			if (gap->seq == idata->rx_expected && gap->state == SLOT_IN_FLIGHT) {
+				gap->state = SLOT_LOST;
+				idata->in_flight--;
+				idata->lost++;
+			}
+		}
+		if (seq == idata->rx_expected) {
+			idata->rx_expected++;
+		}
+	}
+
+	slot->state = SLOT_ACKED;
+	idata->rx_count++;
+
+	if (seq >= warmup) {
+		idata->rx_bytes += idata->msg_size;
+		bench_record(idata, ktime_to_ns(ktime_sub(now, slot->tx_time)));
+	}
+
 	/* samples should not live forever */
-	if (idata->rx_count >= NUM_MESSAGES) {
-		end_time = ktime_get();
-		elapsed = ktime_to_ns(ktime_sub(end_time, start_time));
-		printk("\n--------- TEST RESULTS ---------------\n");
-		printk("messages: %d\n", NUM_MESSAGES);
-		printk("message size: %d\n", MESSAGE_SIZE);
-		printk("elapsed time: %lld us\n", elapsed / 1000);
-
-		rpmsg_send(rpdev->ept, "end", 4);
+	if (idata->rx_expected >= idata->total && !idata->in_flight) {
+		idata->end_time = now;
+		idata->done = true;
+		finished = true;
+	} else if (tx_worker) {
+		/* send new messages now, the stop waits for the work after done is set */
+		queue_work(bench_wq, &idata->tx_work);
+	}
+
+	spin_unlock_irqrestore(&idata->lock, flags);
+
+	if (finished) {
+		bench_finish(idata);
+	} else if (!tx_worker) {
+		bench_tx(idata, false);
+	}
+
+	return 0;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Nearest-rank percentile over the sorted samples
+ * @param idata Instance data
+ * @param permyriad Percentile in units of 0.01%
+ */
+static u64 bench_percentile(struct instance_data *idata, unsigned int permyriad)
+{
+	u64 rank = div_u64((u64)idata->nsamples * permyriad + 9999, 10000);
+
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	return idata->samples[rank - 1];
+}
+
+static void bench_sort_samples(struct instance_data *idata)
+{
+	lockdep_assert_held(&idata->stats_lock);
+
+	if (!idata->sorted) {
+		sort(idata->samples, idata->nsamples, sizeof(u64), bench_cmp_u64, NULL);
+		idata->sorted = true;
+	}
+}
+
+static int bench_stats_show(struct seq_file *s, void *unused)
+{
+	struct instance_data *idata = s->private;
+	s64 elapsed;
+
+	if (!idata->done) {
+		seq_printf(s, "running: %llu/%u round-trips, %u in flight\n", idata->rx_count,
+			   idata->total, idata->in_flight);
 		return 0;
 	}
 
-	/* send a new message now */
-	ret = rpmsg_send(rpdev->ept, msg, MESSAGE_SIZE);
-	if (ret) {
-		dev_err(&rpdev->dev, "rpmsg_send failed: %d\n", ret);
+	mutex_lock(&idata->stats_lock);
+	bench_sort_samples(idata);
+
+	elapsed = ktime_to_ns(ktime_sub(idata->end_time, idata->start_time));
+
+	seq_printf(s, "mode:       %s\n", bench_mode_names[idata->mode]);
+	seq_printf(s, "msg_size:   %u\n", idata->msg_size);
+	seq_printf(s, "window:     %u\n", idata->window);
+	seq_printf(s, "messages:   %u\n", idata->nsamples);
+	seq_printf(s, "warmup:     %u\n", warmup);
+	seq_printf(s, "lost:       %llu\n", idata->lost);
+	seq_printf(s, "reordered:  %llu\n", idata->reordered);
+	seq_printf(s, "duplicates: %llu\n", idata->duplicates);
+	seq_printf(s, "endpoint:   0x%x\n", idata->ept->addr);
+	seq_printf(s, "tx_stalls:  %llu\n", idata->tx_stalls);
+	seq_printf(s, "stall_us:   %llu\n", idata->tx_stall_ns / 1000);
+	seq_printf(s, "tx_errors:  %llu\n", idata->tx_errors);
+	seq_printf(s, "elapsed_us: %lld\n", elapsed / 1000);
+	if (elapsed > 0) {
+		seq_printf(s, "msg_per_s:  %llu\n",
+			   div64_u64((u64)idata->nsamples * NSEC_PER_SEC, elapsed));
+		seq_printf(s, "kb_per_s:   %llu\n",
+			   div64_u64(idata->rx_bytes * (NSEC_PER_SEC / 1000), elapsed));
+	}
+	if (idata->nsamples) {
+		seq_printf(s, "min_ns:     %llu\n", idata->lat_min);
+		seq_printf(s, "avg_ns:     %llu\n", div_u64(idata->lat_sum, idata->nsamples));
+		seq_printf(s, "p50_ns:     %llu\n", bench_percentile(idata, 5000));
+		seq_printf(s, "p90_ns:     %llu\n", bench_percentile(idata, 9000));
+		seq_printf(s, "p99_ns:     %llu\n", bench_percentile(idata, 9900));
+		seq_printf(s, "p99.9_ns:   %llu\n", bench_percentile(idata, 9990));
+		seq_printf(s, "max_ns:     %llu\n", idata->lat_max);
 	}
+	mutex_unlock(&idata->stats_lock);
 
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(bench_stats);
 
-static int rpmsg_sample_probe(struct rpmsg_device *rpdev)
+static int bench_histogram_show(struct seq_file *s, void *unused)
+{
+	struct instance_data *idata = s->private;
+	int i;
+
+	seq_puts(s, "# log2 latency histogram, bucket [lo, hi) in ns\n");
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!idata->hist[i]) {
+			continue;
+		}
+		seq_printf(s, "[%llu, %llu) %llu\n", i ? 1ULL << i : 0ULL, 2ULL << i,
+			   idata->hist[i]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bench_histogram);
+
+/**
+ * @brief Sum up all endpoints of a channel
+ * @param s Output file
+ * @param channel Channel to aggregate
+ *
+ * Throughput is measured over the union of the endpoint runs, from the
+ * first measured send to the last reply.
+ */
+static void bench_aggregate_show(struct seq_file *s, struct bench_channel *channel)
 {
-	int i, ret;
 	struct instance_data *idata;
+	u64 msgs = 0, bytes = 0, lat_sum = 0, lat_max = 0, stalls = 0, lost = 0;
+	ktime_t start = 0, end = 0;
+	s64 elapsed;
+	unsigned int i;
 
-	dev_info(&rpdev->dev, "new channel: 0x%x -> 0x%x!\n", rpdev->src, rpdev->dst);
+	for (i = 0; i < channel->ninstances; i++) {
+		idata = channel->instances[i];
+		if (!idata->done || !idata->nsamples) {
+			seq_printf(s, "%s: running\n", dev_name(&channel->rpdev->dev));
+			return;
+		}
+		if (!i || ktime_before(idata->start_time, start)) {
+			start = idata->start_time;
+		}
+		if (!i || ktime_after(idata->end_time, end)) {
+			end = idata->end_time;
+		}
+		msgs += idata->nsamples;
+		bytes += idata->rx_bytes;
+		lat_sum += idata->lat_sum;
+		lat_max = max(lat_max, idata->lat_max);
+		stalls += idata->tx_stalls;
+		lost += idata->lost;
+	}
+
+	elapsed = max_t(s64, ktime_to_ns(ktime_sub(end, start)), 1);
+	seq_printf(s, "%s: endpoints %u msg_per_s %llu kb_per_s %llu avg_ns %llu max_ns %llu "
+		      "tx_stalls %llu lost %llu\n",
+		   dev_name(&channel->rpdev->dev), channel->ninstances,
+		   div64_u64(msgs * NSEC_PER_SEC, elapsed),
+		   div64_u64(bytes * (NSEC_PER_SEC / 1000), elapsed), div64_u64(lat_sum, msgs),
+		   lat_max, stalls, lost);
+}
+
+/* one line per endpoint so copy and nocopy runs can be compared side by side */
+static int bench_summary_show(struct seq_file *s, void *unused)
+{
+	struct instance_data *idata;
+	s64 elapsed;
+
+	seq_printf(s, "%-8s %-6s %8s %6s %8s %10s %10s %10s %10s %10s %10s %9s\n", "mode", "ept",
+		   "msg_size", "window", "messages", "msg_per_s", "kb_per_s", "p50_ns", "p99_ns",
+		   "p99.9_ns", "max_ns", "tx_stalls");
+
+	mutex_lock(&bench_instances_lock);
+	list_for_each_entry(idata, &bench_instances, node) {
+		if (!idata->done || !idata->nsamples) {
+			seq_printf(s, "%-8s 0x%-4x %8u %6u %8s\n", bench_mode_names[idata->mode],
+				   idata->ept->addr, idata->msg_size, idata->window,
+				   idata->done ? "failed" : "running");
+			continue;
+		}
 
-	printk("rpmsg mtu is %ld\n", rpmsg_get_mtu(rpdev->ept));
+		mutex_lock(&idata->stats_lock);
+		bench_sort_samples(idata);
+		elapsed = max_t(s64, ktime_to_ns(ktime_sub(idata->end_time, idata->start_time)), 1);
+		seq_printf(s, "%-8s 0x%-4x %8u %6u %8u %10llu %10llu %10llu %10llu %10llu %10llu %9llu\n",
+			   bench_mode_names[idata->mode], idata->ept->addr, idata->msg_size,
+			   idata->window, idata->nsamples,
+			   div64_u64((u64)idata->nsamples * NSEC_PER_SEC, elapsed),
+			   div64_u64(idata->rx_bytes * (NSEC_PER_SEC / 1000), elapsed),
+			   bench_percentile(idata, 5000), bench_percentile(idata, 9900),
+			   bench_percentile(idata, 9990), idata->lat_max, idata->tx_stalls);
+		mutex_unlock(&idata->stats_lock);
+	}
+
+	seq_puts(s, "\n# aggregate per channel\n");
+	list_for_each_entry(idata, &bench_instances, node) {
+		if (idata->index == 0) {
+			bench_aggregate_show(s, dev_get_drvdata(&idata->rpdev->dev));
+		}
+	}
+	mutex_unlock(&bench_instances_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bench_summary);
+
+static int bench_sweep_show(struct seq_file *s, void *unused)
+{
+	struct instance_data *idata = s->private;
+	struct bench_sweep_row *row;
+	unsigned int i;
+
+	seq_puts(s, "size,messages,lost,elapsed_us,msg_per_s,kb_per_s,"
+		    "min_ns,avg_ns,p50_ns,p99_ns,max_ns\n");
+
+	mutex_lock(&idata->stats_lock);
+	for (i = 0; i < idata->step && i < idata->nrows; i++) {
+		row = &idata->rows[i];
+		seq_printf(s, "%u,%u,%llu,%lld,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n", row->size,
+			   row->messages, row->lost, row->elapsed_ns / 1000, row->msg_per_s,
+			   row->kb_per_s, row->min_ns, row->avg_ns, row->p50_ns, row->p99_ns,
+			   row->max_ns);
+	}
+	mutex_unlock(&idata->stats_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bench_sweep);
+
+/**
+ * @brief Prepare a new run with the given payload size
+ * @param idata Instance data
+ * @param size Payload size
+ * @return true if the run may start, false if the instance is being stopped
+ */
+static bool bench_reset(struct instance_data *idata, unsigned int size)
+{
+	unsigned long flags;
+	unsigned int i;
+	bool ready;
+
+	idata->msg_size = size;
+	idata->seqhdr = size >= sizeof(struct bench_hdr);
+	/* payloads too small for a sequence number only work in ping-pong */
+	idata->window = idata->seqhdr || idata->mode == BENCH_MODE_NOCOPY ? window : 1;
+
+	/* prepare the message */
+	memset(idata->msg, 'c', idata->slot_size);
+	idata->msg[size - 1] = '\0'; /* null-terminate the message */
+
+	if (idata->shm) {
+		for (i = 0; i < idata->nslots; i++) {
+			memcpy(idata->shm + i * idata->slot_size, idata->msg, size);
+		}
+	}
+
+	spin_lock_irqsave(&idata->lock, flags);
+	idata->tx_seq = 0;
+	idata->in_flight = 0;
+	idata->rx_expected = 0;
+	memset(idata->slots, 0, idata->nslots * sizeof(*idata->slots));
+	idata->rx_count = 0;
+	idata->rx_bytes = 0;
+	idata->lost = 0;
+	idata->reordered = 0;
+	idata->duplicates = 0;
+	idata->tx_stalls = 0;
+	idata->tx_stall_ns = 0;
+	idata->tx_errors = 0;
+	idata->nsamples = 0;
+	idata->sorted = false;
+	memset(idata->hist, 0, sizeof(idata->hist));
+	idata->lat_min = U64_MAX;
+	idata->lat_max = 0;
+	idata->lat_sum = 0;
+	idata->watchdog_rx = 0;
+	idata->done = idata->stopping;
+	ready = !idata->done;
+	spin_unlock_irqrestore(&idata->lock, flags);
+
+	return ready;
+}
+
+/**
+ * @brief Store the finished sweep step and start the next one
+ */
+static void bench_step_work(struct work_struct *work)
+{
+	struct instance_data *idata = container_of(work, struct instance_data, step_work);
+	struct bench_sweep_row *row;
+	bool ready = false;
+	bool last;
+
+	bench_report(idata);
+
+	mutex_lock(&idata->stats_lock);
+	bench_sort_samples(idata);
+
+	row = &idata->rows[idata->step];
+	row->messages = idata->nsamples;
+	row->lost = idata->lost;
+	row->elapsed_ns = max_t(s64, ktime_to_ns(ktime_sub(idata->end_time, idata->start_time)), 1);
+	row->msg_per_s = div64_u64((u64)idata->nsamples * NSEC_PER_SEC, row->elapsed_ns);
+	row->kb_per_s = div64_u64(idata->rx_bytes * (NSEC_PER_SEC / 1000), row->elapsed_ns);
+	if (idata->nsamples) {
+		row->min_ns = idata->lat_min;
+		row->avg_ns = div_u64(idata->lat_sum, idata->nsamples);
+		row->p50_ns = bench_percentile(idata, 5000);
+		row->p99_ns = bench_percentile(idata, 9900);
+		row->max_ns = idata->lat_max;
+	}
+
+	idata->step++;
+	last = idata->step >= idata->nrows;
+	if (!last) {
+		ready = bench_reset(idata, idata->rows[idata->step].size);
+	}
+	mutex_unlock(&idata->stats_lock);
+
+	if (last) {
+		printk("sweep finished, see %s/%s/sweep.csv in debugfs\n", DRIVER_NAME,
+		       dev_name(&idata->rpdev->dev));
+		rpmsg_send(idata->ept, "end", 4);
+		return;
+	}
+	if (!ready) {
+		return;
+	}
+
+	schedule_delayed_work(&idata->watchdog, msecs_to_jiffies(WATCHDOG_MS));
+	bench_tx(idata, true);
+}
+
+/**
+ * @brief Payload sizes of a sweep: every power of two below the mtu, then the mtu
+ * @param idata Instance data
+ * @param mtu Maximum payload size
+ * @return 0 or -ENOMEM
+ */
+static int bench_sweep_init(struct instance_data *idata, unsigned int mtu)
+{
+	unsigned int size, i = 0;
+
+	idata->nrows = ilog2(mtu) + 1 + !is_power_of_2(mtu);
+	idata->rows = devm_kcalloc(&idata->rpdev->dev, idata->nrows, sizeof(*idata->rows),
+				   GFP_KERNEL);
+	if (!idata->rows) {
+		return -ENOMEM;
+	}
+
+	for (size = 1; size < mtu; size <<= 1) {
+		idata->rows[i++].size = size;
+	}
+	idata->rows[i].size = mtu;
+
+	return 0;
+}
+
+/**
+ * @brief Announce the start of the test to the remote
+ * @param idata Instance data
+ * @return 0 or the rpmsg_send error
+ *
+ * In nocopy mode ordinary kernel memory stands in for the carveout shared
+ * with the remote, its physical address is sent along with the init message.
+ */
+static int bench_send_init(struct instance_data *idata)
+{
+	struct bench_shm_info info = {
+		.cmd = "init",
+	};
+
+	if (idata->mode == BENCH_MODE_COPY) {
+		return rpmsg_send(idata->ept, "init", 5);
+	}
+
+	info.addr = cpu_to_le64(virt_to_phys(idata->shm));
+	info.size = cpu_to_le32(idata->shm_size);
+	info.slot_size = cpu_to_le32(idata->slot_size);
+
+	return rpmsg_send(idata->ept, &info, sizeof(info));
+}
+
+/**
+ * @brief Allocate the test state of one endpoint
+ * @param rpdev Remote processor device
+ * @param ept Endpoint the test runs on, NULL if it is created afterwards
+ * @param index Endpoint number within the channel
+ * @param mtu Maximum payload size
+ * @return Instance data or an ERR_PTR
+ */
+static struct instance_data *bench_instance_create(struct rpmsg_device *rpdev,
+						   struct rpmsg_endpoint *ept, unsigned int index,
+						   unsigned int mtu)
+{
+	struct instance_data *idata;
 
 	idata = devm_kzalloc(&rpdev->dev, sizeof(*idata), GFP_KERNEL);
 	if (!idata) {
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
 	}
 
-	dev_set_drvdata(&rpdev->dev, idata);
+	idata->rpdev = rpdev;
+	idata->ept = ept;
+	idata->index = index;
+	idata->mode = rpdev->id.driver_data;
+	idata->slot_size = sweep ? mtu : msg_size;
+	INIT_LIST_HEAD(&idata->node);
 
-	printk("starting speed test\n");
-	/* prepare the message */
-	for (i = 0; i < MESSAGE_SIZE; i++) {
-		msg[i] = 'c';
+	if (sweep && bench_sweep_init(idata, mtu)) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	idata->msg = devm_kzalloc(&rpdev->dev, idata->slot_size, GFP_KERNEL);
+	if (!idata->msg) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	/* room for late replies of a full window before a slot is reused */
+	idata->nslots = roundup_pow_of_two(window) * 2;
+	idata->slots = devm_kcalloc(&rpdev->dev, idata->nslots, sizeof(*idata->slots), GFP_KERNEL);
+	if (!idata->slots) {
+		return ERR_PTR(-ENOMEM);
 	}
-	msg[MESSAGE_SIZE - 1] = '\0'; /* null-terminate the message */
+
+	if (idata->mode == BENCH_MODE_NOCOPY) {
+		idata->shm_size = (size_t)idata->nslots * idata->slot_size;
+		idata->shm = devm_kzalloc(&rpdev->dev, idata->shm_size, GFP_KERNEL);
+		if (!idata->shm) {
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+
+	idata->samples = vmalloc(array_size(num_messages, sizeof(u64)));
+	if (!idata->samples) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	idata->total = warmup + num_messages;
+	spin_lock_init(&idata->lock);
+	mutex_init(&idata->stats_lock);
+	INIT_WORK(&idata->tx_work, bench_tx_work);
+	INIT_WORK(&idata->step_work, bench_step_work);
+	INIT_DELAYED_WORK(&idata->watchdog, bench_watchdog);
+	bench_reset(idata, sweep ? idata->rows[0].size : msg_size);
+
+	return idata;
+}
+
+/**
+ * @brief Announce the test to the remote and send the first window
+ * @param idata Instance data
+ * @return 0 or the rpmsg_send error
+ */
+static int bench_instance_start(struct instance_data *idata)
+{
+	char name[RPMSG_NAME_SIZE + 16];
+	int ret;
 
 	/* send a message to our remote processor */
-	ret = rpmsg_send(rpdev->ept, "init", 5);
-	start_time = ktime_get();
-	ret = rpmsg_send(rpdev->ept, msg, MESSAGE_SIZE);
+	ret = bench_send_init(idata);
 	if (ret) {
-		dev_err(&rpdev->dev, "rpmsg_send failed: %d\n", ret);
+		dev_err(&idata->rpdev->dev, "rpmsg_send failed: %d\n", ret);
 		return ret;
 	}
 
+	if (idata->index) {
+		snprintf(name, sizeof(name), "%s.%u", dev_name(&idata->rpdev->dev), idata->index);
+	} else {
+		strscpy(name, dev_name(&idata->rpdev->dev), sizeof(name));
+	}
+
+	idata->dbg = debugfs_create_dir(name, bench_debugfs);
+	debugfs_create_file("stats", 0444, idata->dbg, idata, &bench_stats_fops);
+	debugfs_create_file("histogram", 0444, idata->dbg, idata, &bench_histogram_fops);
+	if (sweep) {
+		debugfs_create_file("sweep.csv", 0444, idata->dbg, idata, &bench_sweep_fops);
+	}
+
+	mutex_lock(&bench_instances_lock);
+	list_add_tail(&idata->node, &bench_instances);
+	mutex_unlock(&bench_instances_lock);
+
+	schedule_delayed_work(&idata->watchdog, msecs_to_jiffies(WATCHDOG_MS));
+	if (tx_worker) {
+		queue_work(bench_wq, &idata->tx_work);
+	} else {
+		bench_tx(idata, true);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Stop the run of an endpoint and wait for its work
+ * @param idata Instance data
+ *
+ * Once stopping is set no sweep step is scheduled and no run restarts. The
+ * callbacks are fenced next, those still running are waited for and later
+ * ones find done set, so none queues work after it is cancelled. The step
+ * may still arm the watchdog and the watchdog may still send, so the work is
+ * cancelled in that order. The endpoint stays usable for the work until then.
+ */
+static void bench_instance_stop(struct instance_data *idata)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&idata->lock, flags);
+	idata->stopping = true;
+	idata->done = true;
+	spin_unlock_irqrestore(&idata->lock, flags);
+
+	mutex_lock(&idata->ept->cb_lock);
+	mutex_unlock(&idata->ept->cb_lock);
+
+	cancel_work_sync(&idata->step_work);
+	cancel_delayed_work_sync(&idata->watchdog);
+	cancel_work_sync(&idata->tx_work);
+}
+
+/**
+ * @brief Release a stopped endpoint
+ * @param idata Instance data
+ *
+ * The channel endpoint is left to the rpmsg core, its late callbacks find
+ * done set.
+ */
+static void bench_instance_destroy(struct instance_data *idata)
+{
+	debugfs_remove_recursive(idata->dbg);
+
+	mutex_lock(&bench_instances_lock);
+	list_del_init(&idata->node);
+	mutex_unlock(&bench_instances_lock);
+
+	if (idata->index) {
+		rpmsg_destroy_ept(idata->ept);
+	}
+
+	vfree(idata->samples);
+}
+
+/**
+ * @brief Stop every endpoint of a channel and release the extra ones
+ * @param channel Channel to tear down
+ */
+static void bench_channel_destroy(struct bench_channel *channel)
+{
+	unsigned int i;
+
+	for (i = 0; i < channel->ninstances; i++) {
+		bench_instance_stop(channel->instances[i]);
+	}
+
+	for (i = 0; i < channel->ninstances; i++) {
+		bench_instance_destroy(channel->instances[i]);
+	}
+}
+
+static int rpmsg_sample_probe(struct rpmsg_device *rpdev)
+{
+	long int mtu;
+	unsigned int i;
+	int ret;
+	struct bench_channel *channel;
+	struct rpmsg_channel_info chinfo = {
+		.src = RPMSG_ADDR_ANY,
+		.dst = rpdev->dst,
+	};
+	struct rpmsg_endpoint *ept;
+	struct instance_data *idata;
+
+	dev_info(&rpdev->dev, "new channel: 0x%x -> 0x%x!\n", rpdev->src, rpdev->dst);
+
+	mtu = rpmsg_get_mtu(rpdev->ept);
+	printk("rpmsg mtu is %ld\n", mtu);
+
+	if (mtu <= 0 || (!sweep && (!msg_size || msg_size > mtu)) || !num_messages || !window ||
+	    !num_endpoints) {
+		dev_err(&rpdev->dev,
+			"invalid parameters: msg_size=%u num_messages=%u window=%u num_endpoints=%u\n",
+			msg_size, num_messages, window, num_endpoints);
+		return -EINVAL;
+	}
+
+	if (!sweep && window > 1 && msg_size < sizeof(struct bench_hdr) &&
+	    rpdev->id.driver_data == BENCH_MODE_COPY) {
+		dev_err(&rpdev->dev, "window > 1 needs msg_size >= %zu\n", sizeof(struct bench_hdr));
+		return -EINVAL;
+	}
+
+	channel = devm_kzalloc(&rpdev->dev, struct_size(channel, instances, num_endpoints),
+			       GFP_KERNEL);
+	if (!channel) {
+		return -ENOMEM;
+	}
+
+	channel->rpdev = rpdev;
+	dev_set_drvdata(&rpdev->dev, channel);
+	strscpy(chinfo.name, rpdev->id.name, sizeof(chinfo.name));
+
+	for (i = 0; i < num_endpoints; i++) {
+		idata = bench_instance_create(rpdev, i ? NULL : rpdev->ept, i, mtu);
+		if (IS_ERR(idata)) {
+			ret = PTR_ERR(idata);
+			goto err;
+		}
+
+		if (i) {
+			/*
+			 * replies to an extra endpoint come back to its own address,
+			 * its callback may run before rpmsg_create_ept() returns
+			 */
+			ept = rpmsg_create_ept(rpdev, rpmsg_sample_cb, idata, chinfo);
+			if (!ept) {
+				dev_err(&rpdev->dev, "failed to create endpoint %u\n", i);
+				vfree(idata->samples);
+				ret = -ENOMEM;
+				goto err;
+			}
+			idata->ept = ept;
+		} else {
+			rpdev->ept->priv = idata;
+		}
+
+		channel->instances[channel->ninstances++] = idata;
+	}
+
+	printk("starting %s speed test on %u endpoint(s)\n", bench_mode_names[idata->mode],
+	       channel->ninstances);
+
+	/* start every endpoint before any of them can finish */
+	for (i = 0; i < channel->ninstances; i++) {
+		ret = bench_instance_start(channel->instances[i]);
+		if (ret) {
+			goto err;
+		}
+	}
+
 	return 0;
+
+err:
+	bench_channel_destroy(channel);
+	return ret;
 }
 
 static void rpmsg_sample_remove(struct rpmsg_device *rpdev)
 {
+	bench_channel_destroy(dev_get_drvdata(&rpdev->dev));
+
 	dev_info(&rpdev->dev, "rpmsg sample client driver is removed\n");
 }
 
 static struct rpmsg_device_id rpmsg_driver_sample_id_table[] = {
-	{.name = RPMSG_ENDPOINT_NAME},
+	{.name = RPMSG_ENDPOINT_NAME, .driver_data = BENCH_MODE_COPY},
+	{.name = RPMSG_NOCOPY_NAME, .driver_data = BENCH_MODE_NOCOPY},
 	{},
 };
 MODULE_DEVICE_TABLE(rpmsg, rpmsg_driver_sample_id_table);
@@ -119,7 +1235,37 @@ static struct rpmsg_driver rpmsg_sample_client = {
 	.callback = rpmsg_sample_cb,
 	.remove = rpmsg_sample_remove,
 };
-module_rpmsg_driver(rpmsg_sample_client);
+
+static int __init rpmsg_sample_init(void)
+{
+	int ret;
+
+	bench_wq = alloc_workqueue(DRIVER_NAME, WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!bench_wq) {
+		return -ENOMEM;
+	}
+
+	bench_debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+	debugfs_create_file("summary", 0444, bench_debugfs, NULL, &bench_summary_fops);
+
+	ret = register_rpmsg_driver(&rpmsg_sample_client);
+	if (ret) {
+		debugfs_remove_recursive(bench_debugfs);
+		destroy_workqueue(bench_wq);
+	}
+
+	return ret;
+}
+
+static void __exit rpmsg_sample_exit(void)
+{
+	unregister_rpmsg_driver(&rpmsg_sample_client);
+	debugfs_remove_recursive(bench_debugfs);
+	destroy_workqueue(bench_wq);
+}
+
+module_init(rpmsg_sample_init);
+module_exit(rpmsg_sample_exit);
 
 MODULE_DESCRIPTION("Remote processor messaging sample client driver");
 MODULE_LICENSE("GPL v2");
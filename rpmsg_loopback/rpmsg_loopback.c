@@ -0,0 +1,595 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Software stand-in for the remote processor
+ *
+ * Registers rpmsg channels without any remote core behind them and echoes
+ * every message back to its sender, after a configurable delay, jitter and
+ * bandwidth cap. The bridge drivers probe against these channels unchanged,
+ * so their Linux side can be benchmarked and profiled on any machine.
+ *
+ * Marcos Raimondi <marcosraimondi1@gmail.com>
+ */
+
+#include "linux/device.h"
+#include <linux/printk.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/rpmsg.h>
+#include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "rpmsg_internal.h"
+
+#define DRIVER_NAME              "rpmsg_loopback"
+#define MAX_CHANNELS             8
+#define REMOTE_ADDR_BASE         0x400
+#define RPMSG_RESERVED_ADDRESSES 1024
+#define SEND_TIMEOUT_MS          15000
+
+static char *channels = "rpmsg-netlink,kws-app,rpmsg-ttt,rpmsg-client-sample";
+module_param(channels, charp, 0444);
+MODULE_PARM_DESC(channels, "Comma separated list of channel names to announce");
+
+static unsigned int mtu = 496;
+module_param(mtu, uint, 0444);
+MODULE_PARM_DESC(mtu, "Maximum payload size of a message");
+
+static unsigned int queue_len = 256;
+module_param(queue_len, uint, 0444);
+MODULE_PARM_DESC(queue_len, "Messages in flight towards the remote before senders stall");
+
+static unsigned int delay_us;
+module_param(delay_us, uint, 0644);
+MODULE_PARM_DESC(delay_us, "Fixed delay before a message is echoed back");
+
+static unsigned int jitter_us;
+module_param(jitter_us, uint, 0644);
+MODULE_PARM_DESC(jitter_us, "Random extra delay, uniformly distributed in [0, jitter_us]");
+
+static unsigned int bandwidth_kbps;
+module_param(bandwidth_kbps, uint, 0644);
+MODULE_PARM_DESC(bandwidth_kbps, "Link bandwidth cap in KB/s (0 = unlimited)");
+
+static char *swallow = "init,end";
+module_param(swallow, charp, 0444);
+MODULE_PARM_DESC(swallow, "Messages starting with one of these NUL-terminated words are "
+			  "consumed without a reply");
+
+struct lb_msg {
+	struct list_head node;
+	ktime_t due;
+	u32 src;
+	u32 dst;
+	int len;
+	u8 data[];
+};
+
+struct lb_channel {
+	struct rpmsg_device rpdev;
+};
+
+/* the single remote core shared by every channel, like a pair of vrings */
+struct lb_remote {
+	struct device *root;
+	struct lb_channel *channels[MAX_CHANNELS];
+	int nchannels;
+
+	struct mutex endpoints_lock; /* protects endpoints */
+	struct idr endpoints;
+
+	spinlock_t queue_lock; /* protects queue, queued and link_free */
+	struct list_head queue;
+	unsigned int queued;
+	ktime_t link_free;
+	wait_queue_head_t queue_wq;
+	wait_queue_head_t space_wq;
+	struct task_struct *task;
+
+	/* counters */
+	u64 tx_msgs;
+	u64 tx_bytes;
+	u64 rx_msgs;
+	u64 queue_full;
+	u64 dropped;
+
+	struct dentry *dbg;
+};
+
+static struct lb_remote lb;
+
+static const struct rpmsg_endpoint_ops lb_endpoint_ops;
+
+static void lb_ept_release(struct kref *kref)
+{
+	struct rpmsg_endpoint *ept = container_of(kref, struct rpmsg_endpoint, refcount);
+
+	kfree(ept);
+}
+
+/**
+ * @brief Create an endpoint on a loopback channel
+ * @param rpdev Remote processor device
+ * @param cb Rx callback
+ * @param priv Private data handed to the callback
+ * @param chinfo Channel info, src is the requested local address
+ * @return Endpoint or NULL
+ */
+static struct rpmsg_endpoint *lb_create_ept(struct rpmsg_device *rpdev, rpmsg_rx_cb_t cb,
+					    void *priv, struct rpmsg_channel_info chinfo)
+{
+	struct rpmsg_endpoint *ept;
+	int id_min, id_max, id;
+
+	ept = kzalloc(sizeof(*ept), GFP_KERNEL);
+	if (!ept) {
+		return NULL;
+	}
+
+	kref_init(&ept->refcount);
+	mutex_init(&ept->cb_lock);
+	ept->rpdev = rpdev;
+	ept->cb = cb;
+	ept->priv = priv;
+	ept->ops = &lb_endpoint_ops;
+
+	if (chinfo.src == RPMSG_ADDR_ANY) {
+		id_min = RPMSG_RESERVED_ADDRESSES;
+		id_max = 0;
+	} else {
+		id_min = chinfo.src;
+		id_max = chinfo.src + 1;
+	}
+
+	mutex_lock(&lb.endpoints_lock);
+	id = idr_alloc(&lb.endpoints, ept, id_min, id_max, GFP_KERNEL);
+	mutex_unlock(&lb.endpoints_lock);
+	if (id < 0) {
+		pr_err("rpmsg_loopback: Address 0x%x already in use\n", chinfo.src);
+		kref_put(&ept->refcount, lb_ept_release);
+		return NULL;
+	}
+
+	ept->addr = id;
+
+	return ept;
+}
+
+static void lb_destroy_ept(struct rpmsg_endpoint *ept)
+{
+	mutex_lock(&lb.endpoints_lock);
+	idr_remove(&lb.endpoints, ept->addr);
+	mutex_unlock(&lb.endpoints_lock);
+
+	/* make sure in-flight deliveries are done */
+	mutex_lock(&ept->cb_lock);
+	ept->cb = NULL;
+	mutex_unlock(&ept->cb_lock);
+
+	kref_put(&ept->refcount, lb_ept_release);
+}
+
+/**
+ * @brief Time at which the remote answers a message queued now
+ * @param len Size of the message
+ *
+ * Messages leave in order: each one occupies the link for len / bandwidth
+ * and is answered delay plus jitter after it went through.
+ */
+static ktime_t lb_due_time(int len)
+{
+	ktime_t now = ktime_get();
+	unsigned int bw = READ_ONCE(bandwidth_kbps);
+	unsigned int jitter = READ_ONCE(jitter_us);
+	u64 extra_ns = (u64)READ_ONCE(delay_us) * NSEC_PER_USEC;
+
+	lockdep_assert_held(&lb.queue_lock);
+
+	if (ktime_before(lb.link_free, now)) {
+		lb.link_free = now;
+	}
+
+	if (bw) {
+		lb.link_free = ktime_add_ns(lb.link_free, div64_u64((u64)len * NSEC_PER_SEC, (u64)bw * 1000));
+	}
+
+	if (jitter) {
+		extra_ns += (u64)prandom_u32_max(jitter + 1) * NSEC_PER_USEC;
+	}
+
+	return ktime_add_ns(lb.link_free, extra_ns);
+}
+
+/**
+ * @brief Queue a message towards the remote
+ * @param ept Sending endpoint
+ * @param src Source address
+ * @param dst Destination address
+ * @param data Message
+ * @param len Size of the message
+ * @param wait Wait for room in the queue instead of failing with -ENOMEM
+ * @return 0 or error
+ */
+static int lb_send_offchannel_raw(struct rpmsg_endpoint *ept, u32 src, u32 dst, void *data,
+				  int len, bool wait)
+{
+	struct lb_msg *msg, *last;
+	unsigned long flags;
+	long timeout;
+
+	if (len < 0 || len > mtu) {
+		return -EMSGSIZE;
+	}
+
+	msg = kmalloc(sizeof(*msg) + len, GFP_ATOMIC);
+	if (!msg) {
+		return -ENOMEM;
+	}
+
+	msg->src = src;
+	msg->dst = dst;
+	msg->len = len;
+	memcpy(msg->data, data, len);
+
+	spin_lock_irqsave(&lb.queue_lock, flags);
+	while (lb.queued >= queue_len) {
+		lb.queue_full++;
+		spin_unlock_irqrestore(&lb.queue_lock, flags);
+
+		/* a callback answering from the remote thread would wait on itself */
+		if (!wait || current == lb.task) {
+			kfree(msg);
+			return -ENOMEM;
+		}
+
+		timeout = wait_event_interruptible_timeout(lb.space_wq,
+							   READ_ONCE(lb.queued) < queue_len,
+							   msecs_to_jiffies(SEND_TIMEOUT_MS));
+		if (timeout <= 0) {
+			kfree(msg);
+			return timeout ? timeout : -ETIMEDOUT;
+		}
+
+		spin_lock_irqsave(&lb.queue_lock, flags);
+	}
+
+	msg->due = lb_due_time(len);
+	/* jitter never reorders, a vring is a FIFO */
+	if (!list_empty(&lb.queue)) {
+		last = list_last_entry(&lb.queue, struct lb_msg, node);
+		if (ktime_before(msg->due, last->due)) {
+			msg->due = last->due;
+		}
+	}
+	list_add_tail(&msg->node, &lb.queue);
+	lb.queued++;
+	lb.rx_msgs++;
+	spin_unlock_irqrestore(&lb.queue_lock, flags);
+
+	wake_up(&lb.queue_wq);
+
+	return 0;
+}
+
+static int lb_send(struct rpmsg_endpoint *ept, void *data, int len)
+{
+	return lb_send_offchannel_raw(ept, ept->addr, ept->rpdev->dst, data, len, true);
+}
+
+static int lb_sendto(struct rpmsg_endpoint *ept, void *data, int len, u32 dst)
+{
+	return lb_send_offchannel_raw(ept, ept->addr, dst, data, len, true);
+}
+
+static int lb_send_offchannel(struct rpmsg_endpoint *ept, u32 src, u32 dst, void *data, int len)
+{
+	return lb_send_offchannel_raw(ept, src, dst, data, len, true);
+}
+
+static int lb_trysend(struct rpmsg_endpoint *ept, void *data, int len)
+{
+	return lb_send_offchannel_raw(ept, ept->addr, ept->rpdev->dst, data, len, false);
+}
+
+static int lb_trysendto(struct rpmsg_endpoint *ept, void *data, int len, u32 dst)
+{
+	return lb_send_offchannel_raw(ept, ept->addr, dst, data, len, false);
+}
+
+static int lb_trysend_offchannel(struct rpmsg_endpoint *ept, u32 src, u32 dst, void *data,
+				 int len)
+{
+	return lb_send_offchannel_raw(ept, src, dst, data, len, false);
+}
+
+static ssize_t lb_get_mtu(struct rpmsg_endpoint *ept)
+{
+	return mtu;
+}
+
+static const struct rpmsg_endpoint_ops lb_endpoint_ops = {
+	.destroy_ept = lb_destroy_ept,
+	.send = lb_send,
+	.sendto = lb_sendto,
+	.send_offchannel = lb_send_offchannel,
+	.trysend = lb_trysend,
+	.trysendto = lb_trysendto,
+	.trysend_offchannel = lb_trysend_offchannel,
+	.get_mtu = lb_get_mtu,
+};
+
+static const struct rpmsg_device_ops lb_device_ops = {
+	.create_ept = lb_create_ept,
+};
+
+/**
+ * @brief Check whether a message is a control word the remote does not answer
+ * @param msg Message
+ */
+static bool lb_swallowed(struct lb_msg *msg)
+{
+	const char *p = swallow;
+	size_t n;
+
+	while (p && *p) {
+		n = strcspn(p, ",");
+		if (msg->len > n && !memcmp(msg->data, p, n) && msg->data[n] == '\0') {
+			return true;
+		}
+		p += n;
+		if (*p == ',') {
+			p++;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Hand the echo of a message to the Linux endpoint that sent it
+ * @param msg Message, source and destination already swapped
+ */
+static void lb_deliver(struct lb_msg *msg)
+{
+	struct rpmsg_endpoint *ept;
+
+	mutex_lock(&lb.endpoints_lock);
+	ept = idr_find(&lb.endpoints, msg->dst);
+	if (ept) {
+		kref_get(&ept->refcount);
+	}
+	mutex_unlock(&lb.endpoints_lock);
+
+	if (!ept) {
+		lb.dropped++;
+		pr_debug("rpmsg_loopback: No endpoint at 0x%x\n", msg->dst);
+		return;
+	}
+
+	mutex_lock(&ept->cb_lock);
+	if (ept->cb) {
+		ept->cb(ept->rpdev, msg->data, msg->len, ept->priv, msg->src);
+	}
+	mutex_unlock(&ept->cb_lock);
+
+	kref_put(&ept->refcount, lb_ept_release);
+
+	lb.tx_msgs++;
+	lb.tx_bytes += msg->len;
+}
+
+/**
+ * @brief The remote core: answer queued messages once they are due
+ */
+static int lb_remote_thread(void *arg)
+{
+	struct lb_msg *msg;
+	unsigned long flags;
+	ktime_t due;
+	u32 addr;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lb.queue_wq,
+					 !list_empty(&lb.queue) || kthread_should_stop());
+
+		spin_lock_irqsave(&lb.queue_lock, flags);
+		msg = list_first_entry_or_null(&lb.queue, struct lb_msg, node);
+		if (!msg) {
+			spin_unlock_irqrestore(&lb.queue_lock, flags);
+			continue;
+		}
+
+		due = msg->due;
+		if (ktime_after(due, ktime_get())) {
+			spin_unlock_irqrestore(&lb.queue_lock, flags);
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout(&due, HRTIMER_MODE_ABS);
+			continue;
+		}
+
+		list_del(&msg->node);
+		lb.queued--;
+		spin_unlock_irqrestore(&lb.queue_lock, flags);
+
+		wake_up(&lb.space_wq);
+
+		if (!lb_swallowed(msg)) {
+			addr = msg->src;
+			msg->src = msg->dst;
+			msg->dst = addr;
+			lb_deliver(msg);
+		}
+		kfree(msg);
+	}
+
+	return 0;
+}
+
+static int lb_stats_show(struct seq_file *s, void *unused)
+{
+	int i;
+
+	for (i = 0; i < lb.nchannels; i++) {
+		seq_printf(s, "channel:    %s (0x%x)\n", lb.channels[i]->rpdev.id.name,
+			   lb.channels[i]->rpdev.dst);
+	}
+	seq_printf(s, "queued:     %u/%u\n", READ_ONCE(lb.queued), queue_len);
+	seq_printf(s, "rx_msgs:    %llu\n", lb.rx_msgs);
+	seq_printf(s, "tx_msgs:    %llu\n", lb.tx_msgs);
+	seq_printf(s, "tx_bytes:   %llu\n", lb.tx_bytes);
+	seq_printf(s, "queue_full: %llu\n", lb.queue_full);
+	seq_printf(s, "dropped:    %llu\n", lb.dropped);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lb_stats);
+
+static void lb_release_device(struct device *dev)
+{
+	struct rpmsg_device *rpdev = to_rpmsg_device(dev);
+
+	kfree(container_of(rpdev, struct lb_channel, rpdev));
+}
+
+/**
+ * @brief Announce one channel, drivers matching its name probe right away
+ * @param name Channel name
+ * @param index Channel number, picks the remote address
+ * @return 0 or error
+ */
+static int lb_add_channel(const char *name, int index)
+{
+	struct lb_channel *ch;
+	int ret;
+
+	ch = kzalloc(sizeof(*ch), GFP_KERNEL);
+	if (!ch) {
+		return -ENOMEM;
+	}
+
+	strscpy(ch->rpdev.id.name, name, RPMSG_NAME_SIZE);
+	ch->rpdev.src = RPMSG_ADDR_ANY;
+	ch->rpdev.dst = REMOTE_ADDR_BASE + index;
+	ch->rpdev.ops = &lb_device_ops;
+	ch->rpdev.dev.parent = lb.root;
+	ch->rpdev.dev.release = lb_release_device;
+
+	ret = rpmsg_register_device(&ch->rpdev);
+	if (ret) {
+		/* the device reference is dropped, which frees ch */
+		pr_err("rpmsg_loopback: Error registering channel %s: %d\n", name, ret);
+		return ret;
+	}
+
+	lb.channels[lb.nchannels++] = ch;
+	pr_info("rpmsg_loopback: Channel %s at 0x%x\n", name, ch->rpdev.dst);
+
+	return 0;
+}
+
+static void lb_remove_channels(void)
+{
+	while (lb.nchannels) {
+		device_unregister(&lb.channels[--lb.nchannels]->rpdev.dev);
+	}
+}
+
+static int __init rpmsg_loopback_init(void)
+{
+	char *list, *cur, *name;
+	int ret;
+
+	if (!mtu || !queue_len) {
+		return -EINVAL;
+	}
+
+	mutex_init(&lb.endpoints_lock);
+	idr_init(&lb.endpoints);
+	spin_lock_init(&lb.queue_lock);
+	INIT_LIST_HEAD(&lb.queue);
+	init_waitqueue_head(&lb.queue_wq);
+	init_waitqueue_head(&lb.space_wq);
+
+	lb.root = root_device_register(DRIVER_NAME);
+	if (IS_ERR(lb.root)) {
+		return PTR_ERR(lb.root);
+	}
+
+	lb.task = kthread_run(lb_remote_thread, NULL, "rpmsg-loopback");
+	if (IS_ERR(lb.task)) {
+		ret = PTR_ERR(lb.task);
+		goto err_root;
+	}
+
+	list = kstrdup(channels, GFP_KERNEL);
+	if (!list) {
+		ret = -ENOMEM;
+		goto err_thread;
+	}
+
+	cur = list;
+	while ((name = strsep(&cur, ",")) != NULL) {
+		if (!*name) {
+			continue;
+		}
+		if (lb.nchannels >= MAX_CHANNELS) {
+			pr_warn("rpmsg_loopback: Ignoring channel %s, at most %d\n", name,
+				MAX_CHANNELS);
+			continue;
+		}
+		ret = lb_add_channel(name, lb.nchannels);
+		if (ret) {
+			kfree(list);
+			goto err_channels;
+		}
+	}
+	kfree(list);
+
+	lb.dbg = debugfs_create_dir(DRIVER_NAME, NULL);
+	debugfs_create_file("stats", 0444, lb.dbg, NULL, &lb_stats_fops);
+
+	return 0;
+
+err_channels:
+	lb_remove_channels();
+err_thread:
+	kthread_stop(lb.task);
+err_root:
+	root_device_unregister(lb.root);
+	idr_destroy(&lb.endpoints);
+	return ret;
+}
+
+static void __exit rpmsg_loopback_exit(void)
+{
+	struct lb_msg *msg, *tmp;
+
+	debugfs_remove_recursive(lb.dbg);
+
+	/* removing the channels unbinds the drivers and destroys their endpoints */
+	lb_remove_channels();
+	kthread_stop(lb.task);
+	root_device_unregister(lb.root);
+
+	list_for_each_entry_safe(msg, tmp, &lb.queue, node) {
+		list_del(&msg->node);
+		kfree(msg);
+	}
+	idr_destroy(&lb.endpoints);
+
+	pr_info("rpmsg_loopback: Exited module\n");
+}
+
+module_init(rpmsg_loopback_init);
+module_exit(rpmsg_loopback_exit);
+
+MODULE_AUTHOR("Marcos Raimondi <marcosraimondi1@gmail.com>");
+MODULE_DESCRIPTION("Loopback remote processor for rpmsg benchmarking");
+MODULE_LICENSE("GPL v2");
@@ -2,111 +2,729 @@
 /*
  * Remote processor messaging module with netlink
  *
+ * Every rpmsg channel of the service is an instance with its own queues and
+ * counters. Clients talk to it through the generic netlink family
+ * GENL_NAME, described in bridge_genl.h. Any number of monitors can follow
+ * the messages of the remote through the rx multicast group.
+ * With route set, replies from the remote are routed to the client that
+ * sent the request as described in bridge_route.h. With credits set, the
+ * remote only sends as many messages as userspace takes, as described in
+ * bridge_credit.h. With wire set, every message carries the header of
+ * bridge_wire.h, which also holds the sequence number used for routing.
+ *
  * Marcos Raimondi <marcosraimondi1@gmail.com>
  */
 
 #include "linux/device.h"
 #include <linux/printk.h>
-#include <net/sock.h>
+#include <net/genetlink.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/rpmsg.h>
-#include <linux/netlink.h>
 #include <linux/skbuff.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+
+#include "bridge_rx.h"
+#include "bridge_frag.h"
+#include "bridge_tx.h"
+#include "bridge_chan.h"
+#include "bridge_route.h"
+#include "bridge_genl.h"
+#include "bridge_credit.h"
+#include "bridge_wire.h"
 
-#define NETLINK_USER        17
+#define GENL_NAME           "rpmsg_netlink"
 #define RPMSG_ENDPOINT_NAME "rpmsg-netlink"
 #define DRIVER_NAME         "rpmsg_netlink"
 
-struct rpmsg_device *rpmsg_dev = NULL;
+static unsigned int pool_size = 32;
+module_param(pool_size, uint, 0444);
+MODULE_PARM_DESC(pool_size, "Preallocated skbs for messages to userspace (0 = allocate every time)");
+
+static unsigned int coalesce_us;
+module_param(coalesce_us, uint, 0444);
+MODULE_PARM_DESC(coalesce_us, "Pack messages arriving within this time into one NLM_F_MULTI skb (0 = off)");
+
+static unsigned int coalesce_bytes = 4096;
+module_param(coalesce_bytes, uint, 0444);
+MODULE_PARM_DESC(coalesce_bytes, "Payload after which a coalesced skb is sent right away");
+
+static unsigned int rx_slots = 64;
+module_param(rx_slots, uint, 0444);
+MODULE_PARM_DESC(rx_slots, "Messages buffered between the rpmsg callback and the rx worker");
+
+static unsigned int rx_prio = BRIDGE_RX_PRIO_NORMAL;
+module_param(rx_prio, uint, 0444);
+MODULE_PARM_DESC(rx_prio, "Rx worker scheduling: 0 = normal, 1 = SCHED_FIFO low, 2 = SCHED_FIFO");
+
+static unsigned int tx_queue = 64;
+module_param(tx_queue, uint, 0444);
+MODULE_PARM_DESC(tx_queue, "Messages queued towards the remote before senders get -EAGAIN "
+			   "(0 = wait in rpmsg_send)");
+
+static unsigned int tx_coalesce_us;
+module_param(tx_coalesce_us, uint, 0444);
+MODULE_PARM_DESC(tx_coalesce_us, "Pack small messages queued within this time into one rpmsg "
+				 "buffer, needs tx_queue and no frag (0 = off)");
+
+static bool frag;
+module_param(frag, bool, 0444);
+MODULE_PARM_DESC(frag, "Frame messages with a fragment header, allows messages over the mtu");
+
+static unsigned int frag_max = 16384;
+module_param(frag_max, uint, 0444);
+MODULE_PARM_DESC(frag_max, "Largest fragmented message in either direction");
+
+static unsigned int frag_timeout_ms = 500;
+module_param(frag_timeout_ms, uint, 0444);
+MODULE_PARM_DESC(frag_timeout_ms, "Time allowed to receive all the fragments of a message");
+
+static bool route;
+module_param(route, bool, 0444);
+MODULE_PARM_DESC(route, "Tag requests with a sequence number the remote echoes, and send every "
+			"reply to the client of its request");
+
+static unsigned int route_max = 64;
+module_param(route_max, uint, 0444);
+MODULE_PARM_DESC(route_max, "Requests in flight per channel before the oldest is forgotten");
+
+static unsigned int route_timeout_ms = 1000;
+module_param(route_timeout_ms, uint, 0444);
+MODULE_PARM_DESC(route_timeout_ms, "Time the remote has to answer a request");
+
+static unsigned int credits;
+module_param(credits, uint, 0444);
+MODULE_PARM_DESC(credits, "Messages the remote may send ahead of userspace, up to rx_slots "
+			  "(0 = no flow control)");
+
+static bool wire;
+module_param(wire, bool, 0444);
+MODULE_PARM_DESC(wire, "Frame every message with the versioned header of bridge_wire.h");
+
+static struct genl_family nl_family;
+static struct bridge_chan_table chans;
+static struct dentry *dbg_root;
+
 struct driver_data {
-	struct sock *nl_sk;
-	int client_pid;
+	int id;
+	struct rpmsg_device *rpdev;
+	spinlock_t client_lock; /* the client and its filter change together */
+	u32 client_pid; /* port receiving the messages of the channel */
+	struct bridge_filter __rcu *client_filter;
+	u64 messages;
+	u64 multicast;
+	u64 filtered; /* messages the filter of the client dropped */
+
+	/* mtu sized skbs, taken in the rx callback and refilled from a work item */
+	struct sk_buff_head pool;
+	struct work_struct pool_work;
+	int pool_payload;
+	u64 pool_hits;
+	u64 pool_misses;
+
+	/* multi-part skb being filled while coalescing */
+	spinlock_t batch_lock;
+	struct sk_buff *batch;
+	u32 batch_portid;
+	int batch_bytes;
+	struct hrtimer batch_timer;
+	u64 batches;
+	u64 batched_msgs;
+
+	struct bridge_rx rx;
+	struct bridge_frag frag;
+	struct bridge_tx tx;
+	struct bridge_route route;
+	struct bridge_credit credit;
+	struct bridge_wire wire;
+
+	struct dentry *dbg;
 };
 
-static int msg_cnt = 0;
+/**
+ * @brief Top up the skb pool, runs off the rx path
+ * @param work Pool work of the device
+ */
+static void pool_refill_work(struct work_struct *work)
+{
+	struct driver_data *data = container_of(work, struct driver_data, pool_work);
+	struct sk_buff *skb;
+
+	while (skb_queue_len(&data->pool) < pool_size) {
+		skb = nlmsg_new(data->pool_payload, GFP_KERNEL);
+		if (!skb) {
+			break;
+		}
+		skb_queue_tail(&data->pool, skb);
+	}
+}
+
+/**
+ * @brief Get an skb for a message to userspace
+ * @param data Device data
+ * @param msg_size Size of the message
+ * @return skb or NULL
+ *
+ * Falls back to allocating when the pool is empty or the message does not fit.
+ */
+static struct sk_buff *pool_get(struct driver_data *data, int msg_size)
+{
+	struct sk_buff *skb = NULL;
+
+	if (msg_size <= data->pool_payload) {
+		skb = skb_dequeue(&data->pool);
+	}
+
+	if (skb) {
+		data->pool_hits++;
+	} else {
+		data->pool_misses++;
+		skb = nlmsg_new(msg_size, GFP_ATOMIC);
+	}
+
+	if (skb_queue_len(&data->pool) < pool_size) {
+		schedule_work(&data->pool_work);
+	}
+
+	return skb;
+}
+
+static int stats_show(struct seq_file *s, void *unused)
+{
+	struct driver_data *data = s->private;
+
+	seq_printf(s, "channel:     %d\n", data->id);
+	seq_printf(s, "messages:    %llu\n", data->messages);
+	seq_printf(s, "multicast:   %llu\n", data->multicast);
+	seq_printf(s, "filtered:    %llu\n", data->filtered);
+	seq_printf(s, "pool:        %u/%u\n", skb_queue_len(&data->pool), pool_size);
+	seq_printf(s, "pool_hits:   %llu\n", data->pool_hits);
+	seq_printf(s, "pool_misses: %llu\n", data->pool_misses);
+	seq_printf(s, "batches:     %llu\n", data->batches);
+	seq_printf(s, "batched:     %llu\n", data->batched_msgs);
+	bridge_rx_show(s, &data->rx);
+	if (tx_queue) {
+		bridge_tx_show(s, &data->tx);
+	}
+	if (frag) {
+		bridge_frag_show(s, &data->frag);
+	}
+	if (route) {
+		bridge_route_show(s, &data->route);
+	}
+	if (credits) {
+		bridge_credit_show(s, &data->credit);
+	}
+	if (wire) {
+		bridge_wire_show(s, &data->wire);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
 
 /**
  * @brief Send a message to userspace
+ * @param data Device data
  * @param msg Message to send
  * @param msg_size Size of the message
- * @param pid Process ID of the user
+ * @param pid Process ID of the user, 0 for the members of the rx group
+ * @param nl_seq nlmsg_seq of the request this message answers, or 0
+ * @return 0 if somebody got the message, or error
  */
-static void send_msg_to_userspace(char *msg, int msg_size, struct sock *nl_sock, int pid)
+static int send_msg_to_userspace(struct driver_data *data, char *msg, int msg_size, u32 pid,
+				 u32 nl_seq)
 {
-	struct nlmsghdr *nlh;
 	struct sk_buff *skb_out;
 	int res;
 
 	// create reply
-	skb_out = nlmsg_new(msg_size, 0);
+	skb_out = pool_get(data, bridge_genl_msg_size(msg_size));
 	if (!skb_out) {
 		pr_err("rpmsg_netlink: Failed to allocate new skb\n");
-		return;
+		return -ENOMEM;
 	}
 
 	// put received message into reply
-	nlh = nlmsg_put(skb_out, 0, 0, NLMSG_DONE, msg_size, 0);
-	NETLINK_CB(skb_out).dst_group = 0; /* not in mcast group */
-	memcpy(nlmsg_data(nlh), msg, msg_size);
+	if (bridge_genl_put_msg(skb_out, &nl_family, nl_seq, 0, data->id, msg, msg_size)) {
+		nlmsg_free(skb_out);
+		pr_err("rpmsg_netlink: Message too long for the skb\n");
+		return -EMSGSIZE;
+	}
+
+	pr_debug("rpmsg_netlink: Sending user %d bytes\n", msg_size);
+
+	if (!pid) {
+		// netlink clones it for every member, nobody listening is not an error
+		data->multicast++;
+		return genlmsg_multicast(&nl_family, skb_out, 0, BRIDGE_GENL_GRP_RX, GFP_KERNEL);
+	}
+
+	res = genlmsg_unicast(&init_net, skb_out, pid);
+	if (res < 0) {
+		pr_err("rpmsg_netlink: Error while sending skb to user\n");
+	}
+
+	return res;
+}
+
+/**
+ * @brief Close the skb being coalesced with NLMSG_DONE and send it to userspace
+ * @param data Device data
+ */
+static void batch_flush(struct driver_data *data)
+{
+	struct sk_buff *skb;
+	unsigned long flags;
+	u32 portid;
+	int res;
 
-	pr_debug("rpmsg_netlink: Sending user %s\n", msg);
+	// the next batch may be for another client as soon as the lock is dropped
+	spin_lock_irqsave(&data->batch_lock, flags);
+	skb = data->batch;
+	portid = data->batch_portid;
+	data->batch = NULL;
+	if (skb) {
+		data->batches++;
+	}
+	spin_unlock_irqrestore(&data->batch_lock, flags);
 
-	res = nlmsg_unicast(nl_sock, skb_out, pid);
+	if (!skb) {
+		return;
+	}
+
+	nlmsg_put(skb, 0, 0, NLMSG_DONE, 0, NLM_F_MULTI);
+
+	res = genlmsg_unicast(&init_net, skb, portid);
 	if (res < 0) {
 		pr_err("rpmsg_netlink: Error while sending skb to user\n");
+		if (credits) {
+			bridge_credit_drop(&data->credit);
+		}
+	} else if (credits) {
+		bridge_credit_consume_all(&data->credit);
 	}
 }
 
+static enum hrtimer_restart batch_timer_cb(struct hrtimer *timer)
+{
+	struct driver_data *data = container_of(timer, struct driver_data, batch_timer);
+
+	batch_flush(data);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief Append a message to the skb being coalesced
+ * @param data Device data
+ * @param pid Process ID of the user
+ * @param nl_seq nlmsg_seq of the request this message answers, or 0
+ * @param msg Message to send
+ * @param msg_size Size of the message
+ * @return 0 or -ENOMEM
+ *
+ * Each message becomes an NLM_F_MULTI part. The skb is sent when the next
+ * message does not fit or goes to another client, coalesce_bytes are
+ * reached or coalesce_us expire.
+ */
+static int batch_add(struct driver_data *data, u32 pid, u32 nl_seq, char *msg, int msg_size)
+{
+	int size = bridge_genl_msg_size(msg_size);
+	unsigned long flags;
+	bool full;
+
+	spin_lock_irqsave(&data->batch_lock, flags);
+
+	if (data->batch &&
+	    (data->batch_portid != pid ||
+	     skb_tailroom(data->batch) < nlmsg_total_size(size) + nlmsg_total_size(0))) {
+		spin_unlock_irqrestore(&data->batch_lock, flags);
+		batch_flush(data);
+		spin_lock_irqsave(&data->batch_lock, flags);
+	}
+
+	if (!data->batch) {
+		data->batch = pool_get(data, data->pool_payload);
+		if (!data->batch) {
+			spin_unlock_irqrestore(&data->batch_lock, flags);
+			pr_err("rpmsg_netlink: Failed to allocate new skb\n");
+			return -ENOMEM;
+		}
+		NETLINK_CB(data->batch).dst_group = 0; /* not in mcast group */
+		data->batch_portid = pid;
+		data->batch_bytes = 0;
+		hrtimer_start(&data->batch_timer, ns_to_ktime((u64)coalesce_us * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL_SOFT);
+	}
+
+	// always fits, checked above
+	if (!bridge_genl_put_msg(data->batch, &nl_family, nl_seq, NLM_F_MULTI, data->id, msg,
+				 msg_size)) {
+		data->batch_bytes += msg_size;
+		data->batched_msgs++;
+	}
+	full = data->batch_bytes >= coalesce_bytes;
+
+	spin_unlock_irqrestore(&data->batch_lock, flags);
+
+	if (full) {
+		hrtimer_try_to_cancel(&data->batch_timer);
+		batch_flush(data);
+	}
+
+	return 0;
+}
+
 /**
  * @brief Send a message to the remote processor
  * @param rpdev Remote processor device
  * @param msg Message to send
  * @param len Size of the message
+ * @param nowait Fail with -ENOMEM instead of waiting for a tx buffer
+ * @return 0 or error
  */
-static void send_rpmsg(struct rpmsg_device *rpdev, char *msg, int len)
+static int send_rpmsg(struct rpmsg_device *rpdev, char *msg, int len, bool nowait)
 {
+	struct driver_data *data = dev_get_drvdata(&rpdev->dev);
 	int ret;
 	long int mtu = rpmsg_get_mtu(rpdev->ept);
 
 	pr_debug("rpmsg_netlink: Sending %d bytes to remote (mtu=%ld)\n", len, mtu);
 
+	if (tx_queue) {
+		// never waits for the remote, a full queue is returned to the client
+		return bridge_tx_queue(&data->tx, msg, len);
+	}
+
+	if (frag) {
+		ret = bridge_frag_send(&data->frag, rpdev->ept, rpdev->dst, msg, len, nowait);
+		if (ret && !(nowait && ret == -ENOMEM)) {
+			pr_err("rpmsg_netlink: Fragmented send failed: %d\n", ret);
+		}
+		return ret;
+	}
+
 	if (len > mtu) {
 		pr_err("rpmsg_netlink: Message too long\n");
-		return;
+		return -EMSGSIZE;
 	}
 
-	ret = rpmsg_send(rpdev->ept, msg, len);
+	if (nowait) {
+		ret = rpmsg_trysend(rpdev->ept, msg, len);
+	} else {
+		ret = rpmsg_send(rpdev->ept, msg, len);
+	}
 
-	if (ret) {
+	if (ret && !(nowait && ret == -ENOMEM)) {
 		pr_err("rpmsg_netlink: rpmsg_send failed: %d\n", ret);
-		return;
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Send a message to the remote, behind the wire header if it is on
+ * @param data Device data
+ * @param type BRIDGE_WIRE_*
+ * @param seq Request the message is, 0 for none
+ * @param msg Payload
+ * @param len Size of the payload
+ * @param nowait Fail with -ENOMEM instead of waiting for a tx buffer
+ * @return 0 or error
+ */
+static int send_wire(struct driver_data *data, u8 type, u32 seq, void *msg, int len, bool nowait)
+{
+	void *buf;
+	int size;
+	int ret;
+
+	if (!wire) {
+		return send_rpmsg(data->rpdev, msg, len, nowait);
+	}
+
+	buf = bridge_wire_build(type, seq, msg, len, &size);
+	if (!buf) {
+		return -ENOBUFS;
+	}
+	ret = send_rpmsg(data->rpdev, buf, size, nowait);
+	kfree(buf);
+
+	return ret;
+}
+
+/**
+ * @brief Forward a request to the remote, tagged for routing its reply
+ * @param data Device data
+ * @param portid Netlink port of the sender
+ * @param nl_seq nlmsg_seq of the request
+ * @param flags BRIDGE_F_* of the request
+ * @param msg Message to send
+ * @param len Size of the message
+ * @param nowait Fail with -ENOMEM instead of waiting for a tx buffer
+ * @return 0 or error
+ *
+ * Requests sent with BRIDGE_F_NO_REPLY go out with sequence 0 and are not
+ * kept in flight. The sequence number goes in the wire header when it is on,
+ * in a struct bridge_route_hdr otherwise.
+ */
+static int send_routed(struct driver_data *data, u32 portid, u32 nl_seq, u32 flags, void *msg,
+		       int len, bool nowait)
+{
+	struct bridge_route_hdr *hdr;
+	u32 seq = 0;
+	int ret;
+
+	if (!(flags & BRIDGE_F_NO_REPLY)) {
+		ret = bridge_route_add(&data->route, portid, nl_seq, &seq);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (wire) {
+		ret = send_wire(data, BRIDGE_WIRE_DATA, seq, msg, len, nowait);
+	} else {
+		hdr = kmalloc(sizeof(*hdr) + len, GFP_KERNEL);
+		if (hdr) {
+			hdr->seq = cpu_to_le32(seq);
+			memcpy(hdr + 1, msg, len);
+			ret = send_rpmsg(data->rpdev, (char *)hdr, sizeof(*hdr) + len, nowait);
+			kfree(hdr);
+		} else {
+			ret = -ENOBUFS;
+		}
+	}
+	if (ret && seq) {
+		bridge_route_cancel(&data->route, seq);
 	}
+
+	return ret;
+}
+
+/**
+ * @brief Send a credit grant to the remote
+ * @param c Credits of the channel
+ * @param msg Grant
+ * @param len Size of the grant
+ * @return 0 or error
+ *
+ * Runs from the credit work, which retries a grant that found no tx buffer
+ * instead of waiting for one.
+ */
+static int credit_send(struct bridge_credit *c, void *msg, int len)
+{
+	struct driver_data *data = container_of(c, struct driver_data, credit);
+	int ret;
+
+	// with route set and no wire header the remote expects a route header,
+	// a grant answers nothing
+	if (route && !wire) {
+		ret = send_routed(data, 0, 0, BRIDGE_F_NO_REPLY, msg, len, true);
+	} else {
+		ret = send_wire(data, BRIDGE_WIRE_CREDIT, 0, msg, len, true);
+	}
+	if (!ret && tx_queue) {
+		// the remote may be waiting for it
+		bridge_tx_flush(&data->tx);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief BRIDGE_CMD_SEND, forward a message to the remote
+ * @param skb Socket buffer
+ * @param info Request, validated against bridge_genl_policy
+ * @return 0 or error, reported to the client in the ack
+ *
+ * Backpressure from the tx queue is returned as -EAGAIN or -ENOBUFS, the
+ * client has to retry.
+ */
+static int genl_send_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *attr = info->attrs[BRIDGE_ATTR_DATA];
+	struct driver_data *data;
+	bool new_client;
+	u32 flags;
+	int ret;
+	int idx;
+	int id;
+
+	id = bridge_genl_parse(info, &flags);
+	if (id < 0) {
+		return id;
+	}
+	if (!attr) {
+		GENL_SET_ERR_MSG(info, "missing data");
+		return -EINVAL;
+	}
+
+	// remove() waits for this before tearing a channel down
+	idx = srcu_read_lock(&chans.srcu);
+
+	data = bridge_chan_get(&chans, id);
+	if (data) {
+		new_client = false;
+		if (!(flags & BRIDGE_F_NO_REPLY)) {
+			spin_lock(&data->client_lock);
+			if (data->client_pid != info->snd_portid) {
+				// the filter belonged to the previous client
+				data->client_pid = info->snd_portid;
+				bridge_filter_swap(&data->client_filter, NULL);
+				new_client = true;
+			}
+			spin_unlock(&data->client_lock);
+		}
+		if (new_client && credits) {
+			// what was held back is stale, let the remote send again
+			bridge_credit_consume_all(&data->credit);
+		}
+		pr_debug("rpmsg_netlink: Received %d bytes from port %u\n", nla_len(attr),
+			 info->snd_portid);
+		data->messages++;
+		if (route) {
+			ret = send_routed(data, info->snd_portid, info->snd_seq, flags,
+					  nla_data(attr), nla_len(attr), false);
+		} else {
+			ret = send_wire(data, BRIDGE_WIRE_DATA, 0, nla_data(attr), nla_len(attr),
+					false);
+		}
+		if (!ret && (flags & BRIDGE_F_FLUSH) && tx_queue) {
+			bridge_tx_flush(&data->tx);
+		}
+	} else {
+		ret = -ENODEV;
+	}
+
+	srcu_read_unlock(&chans.srcu, idx);
+
+	return ret;
+}
+
+/**
+ * @brief Fill the answer to BRIDGE_CMD_STATS
+ * @param skb Answer
+ * @param info Request
+ * @param data Device data
+ * @return 0 or -EMSGSIZE
+ */
+static int stats_fill(struct sk_buff *skb, struct genl_info *info, struct driver_data *data)
+{
+	struct nlattr *nest;
+	void *hdr;
+
+	hdr = genlmsg_put_reply(skb, info, &nl_family, 0, BRIDGE_CMD_STATS);
+	if (!hdr || nla_put_u32(skb, BRIDGE_ATTR_CHANNEL, data->id)) {
+		return -EMSGSIZE;
+	}
+
+	nest = nla_nest_start(skb, BRIDGE_ATTR_STATS);
+	if (!nest || bridge_genl_put_rx(skb, &data->rx) ||
+	    bridge_genl_put_stat(skb, BRIDGE_STAT_NL_FILTERED, data->filtered) ||
+	    (tx_queue && bridge_genl_put_tx(skb, &data->tx)) ||
+	    (credits && bridge_genl_put_credit(skb, &data->credit))) {
+		return -EMSGSIZE;
+	}
+	nla_nest_end(skb, nest);
+	genlmsg_end(skb, hdr);
+
+	return 0;
 }
 
 /**
- * @brief Callback for netlink messages received from userspace
+ * @brief BRIDGE_CMD_STATS, answer with the counters of a channel
  * @param skb Socket buffer
+ * @param info Request
+ * @return 0 or error
  */
-static void netlink_recv_cb(struct sk_buff *skb)
+static int genl_stats_doit(struct sk_buff *skb, struct genl_info *info)
 {
-	struct nlmsghdr *nlh;
-	int msg_size;
-	char *msg;
+	struct driver_data *data;
+	struct sk_buff *msg;
+	u32 flags;
+	int ret;
+	int idx;
+	int id;
 
-	struct driver_data *data = dev_get_drvdata(&rpmsg_dev->dev);
+	id = bridge_genl_parse(info, &flags);
+	if (id < 0) {
+		return id;
+	}
 
-	nlh = (struct nlmsghdr *)skb->data;
-	data->client_pid = nlh->nlmsg_pid; /* pid of sending process */
-	msg = (char *)nlmsg_data(nlh);
-	msg_size = nlmsg_len(nlh);
+	msg = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg) {
+		return -ENOMEM;
+	}
 
-	pr_debug("rpmsg_netlink: Received from pid %d: %s\n", data->client_pid, msg);
+	idx = srcu_read_lock(&chans.srcu);
+	data = bridge_chan_get(&chans, id);
+	ret = data ? stats_fill(msg, info, data) : -ENODEV;
+	srcu_read_unlock(&chans.srcu, idx);
 
-	if (rpmsg_dev) {
-		msg_cnt++;
-		send_rpmsg(rpmsg_dev, msg, msg_size);
+	if (ret) {
+		nlmsg_free(msg);
+		return ret;
 	}
+
+	return genlmsg_reply(msg, info);
+}
+
+/**
+ * @brief BRIDGE_CMD_SUBSCRIBE, receive the messages of a channel without sending
+ * @param skb Socket buffer
+ * @param info Request, with the filter of the subscriber if it has one
+ * @return 0 or error
+ */
+static int genl_subscribe_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct bridge_filter *filter;
+	struct driver_data *data;
+	u32 flags;
+	int ret = 0;
+	int idx;
+	int id;
+
+	id = bridge_genl_parse(info, &flags);
+	if (id < 0) {
+		return id;
+	}
+	filter = bridge_genl_filter(info);
+	if (IS_ERR(filter)) {
+		return PTR_ERR(filter);
+	}
+
+	idx = srcu_read_lock(&chans.srcu);
+	data = bridge_chan_get(&chans, id);
+	if (!data) {
+		ret = -ENODEV;
+	} else if (!(flags & BRIDGE_F_UNSUBSCRIBE)) {
+		spin_lock(&data->client_lock);
+		data->client_pid = info->snd_portid;
+		bridge_filter_swap(&data->client_filter, filter);
+		spin_unlock(&data->client_lock);
+		filter = NULL;
+		if (credits) {
+			bridge_credit_consume_all(&data->credit);
+		}
+	} else {
+		spin_lock(&data->client_lock);
+		if (data->client_pid == info->snd_portid) {
+			data->client_pid = 0;
+			bridge_filter_swap(&data->client_filter, NULL);
+		}
+		spin_unlock(&data->client_lock);
+	}
+	srcu_read_unlock(&chans.srcu, idx);
+
+	bridge_filter_free(filter);
+
+	return ret;
 }
 
 /**
@@ -121,21 +739,162 @@ static void netlink_recv_cb(struct sk_buff *skb)
 static int rpmsg_recv_cb(struct rpmsg_device *rpdev, void *data, int len, void *priv, u32 src)
 {
 	struct driver_data *drv_data;
+	int ret;
 
-	pr_debug("rpmsg_netlink: (src: 0x%x) %s\n", src, (char *)data);
+	pr_debug("rpmsg_netlink: (src: 0x%x) %d bytes\n", src, len);
 
 	drv_data = dev_get_drvdata(&rpdev->dev);
-	if (drv_data->client_pid > 0) {
-		send_msg_to_userspace(data, len, drv_data->nl_sk, drv_data->client_pid);
-	} else {
-		pr_err("rpmsg_netlink: No user connected\n");
+	ret = bridge_rx_queue(&drv_data->rx, data, len);
+	if (ret && ret != -ESHUTDOWN) {
+		pr_err_ratelimited("rpmsg_netlink: Rx ring full, message dropped\n");
 	}
 
 	return 0;
 }
 
-struct netlink_kernel_cfg cfg = {
-	.input = netlink_recv_cb,
+/**
+ * @brief Read the client of a channel and run its filter on a message
+ * @param data Device data
+ * @param msg Message
+ * @param len Size of the message
+ * @param pid Port of the client, 0 for none
+ * @return true if there is no client or its filter takes the message
+ *
+ * The port and the filter are read together, so a client never gets the
+ * filter of the one before it.
+ */
+static bool client_match(struct driver_data *data, void *msg, int len, u32 *pid)
+{
+	struct bridge_filter *filter;
+	bool match;
+
+	rcu_read_lock();
+	spin_lock(&data->client_lock);
+	*pid = data->client_pid;
+	filter = rcu_dereference(data->client_filter);
+	spin_unlock(&data->client_lock);
+	match = !*pid || bridge_filter_match(filter, msg, len);
+	rcu_read_unlock();
+
+	return match;
+}
+
+/**
+ * @brief Deliver a message from the remote to userspace, runs in the rx worker
+ * @param rx Rx path of the device
+ * @param data Data received
+ * @param len Size of the data
+ */
+static void rx_deliver(struct bridge_rx *rx, void *data, int len)
+{
+	struct driver_data *drv_data = container_of(rx, struct driver_data, rx);
+	struct bridge_wire_hdr *whdr;
+	struct bridge_route_hdr *hdr;
+	u32 nl_seq = 0;
+	u32 pid;
+	u32 seq = 0;
+	bool delivered = false;
+	bool dropped = false;
+	bool reply = false;
+	bool monitored;
+	bool match;
+	int ret;
+
+	if (frag && bridge_frag_rx(&drv_data->frag, &data, &len)) {
+		return;
+	}
+
+	if (wire) {
+		// control messages are for the kernel, not for the clients
+		whdr = bridge_wire_rx(&drv_data->wire, &data, &len);
+		if (!whdr || whdr->type != BRIDGE_WIRE_DATA) {
+			return;
+		}
+		seq = le32_to_cpu(whdr->seq);
+		pr_debug("rpmsg_netlink: seq %u, %d bytes\n", seq, len);
+	} else if (route) {
+		if (len < sizeof(*hdr)) {
+			pr_err_ratelimited("rpmsg_netlink: Message without route header\n");
+			return;
+		}
+		hdr = data;
+		seq = le32_to_cpu(hdr->seq);
+		data = hdr + 1;
+		len -= sizeof(*hdr);
+	}
+
+	if (credits) {
+		bridge_credit_rx(&drv_data->credit);
+	}
+
+	// the client filters what it did not ask for, before any skb is taken for it
+	match = client_match(drv_data, data, len, &pid);
+
+	if (route) {
+		// replies go to the sender of the request, anything else to the last client
+		reply = bridge_route_match(&drv_data->route, seq, &pid, &nl_seq);
+	}
+
+	// monitors see every message, replies included
+	monitored = bridge_genl_has_subscribers(&nl_family);
+	if (monitored) {
+		// -ESRCH, the last monitor just left
+		ret = send_msg_to_userspace(drv_data, data, len, 0, nl_seq);
+		delivered = !ret;
+		dropped = ret && ret != -ESRCH;
+	}
+
+	if (!reply && !match) {
+		// as good as taken by the client
+		drv_data->filtered++;
+		delivered = true;
+	} else if (pid && coalesce_us &&
+		   bridge_genl_msg_size(len) + NLMSG_HDRLEN <= drv_data->pool_payload) {
+		// coalesced messages return their credits when the batch is sent
+		dropped |= batch_add(drv_data, pid, nl_seq, data, len) != 0;
+	} else if (pid) {
+		ret = send_msg_to_userspace(drv_data, data, len, pid, nl_seq);
+		delivered |= !ret;
+		dropped |= ret != 0;
+	} else if (!monitored) {
+		pr_err("rpmsg_netlink: No user connected\n");
+	}
+
+	// a consumer with room took the message and every one before it, one
+	// without room loses it instead of stopping the remote for good
+	if (credits && dropped) {
+		bridge_credit_drop(&drv_data->credit);
+	} else if (credits && delivered) {
+		bridge_credit_consume_all(&drv_data->credit);
+	}
+}
+
+static const struct genl_ops nl_ops[] = {
+	{
+		.cmd = BRIDGE_CMD_SEND,
+		.doit = genl_send_doit,
+	},
+	{
+		.cmd = BRIDGE_CMD_STATS,
+		.doit = genl_stats_doit,
+	},
+	{
+		.cmd = BRIDGE_CMD_SUBSCRIBE,
+		.doit = genl_subscribe_doit,
+	},
+};
+
+static struct genl_family nl_family = {
+	.name = GENL_NAME,
+	.version = BRIDGE_GENL_VERSION,
+	.maxattr = BRIDGE_ATTR_MAX,
+	.policy = bridge_genl_policy,
+	.parallel_ops = true, /* channels are looked up under SRCU */
+	.ops = nl_ops,
+	.n_ops = ARRAY_SIZE(nl_ops),
+	.mcgrps = bridge_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(bridge_genl_mcgrps),
+	.module = THIS_MODULE,
 };
 
 /**
@@ -146,9 +905,10 @@ struct netlink_kernel_cfg cfg = {
 static int rpmsg_netlink_probe(struct rpmsg_device *rpdev)
 {
 	struct driver_data *data;
+	char name[TASK_COMM_LEN];
+	int mtu;
+	int ret;
 
-	// save rpmsg device
-	rpmsg_dev = rpdev;
 	pr_info("rpmsg_netlink: New channel (src) 0x%x -> (dst) 0x%x\n", rpdev->src, rpdev->dst);
 
 	pr_info("rpmsg_netlink: mtu %ld\n", rpmsg_get_mtu(rpdev->ept));
@@ -159,18 +919,86 @@ static int rpmsg_netlink_probe(struct rpmsg_device *rpdev)
 		pr_err("rpmsg_netlink: Error allocating memory.\n");
 		return -ENOMEM;
 	}
+	data->rpdev = rpdev;
 
-	// create netlink socket
-	data->nl_sk = netlink_kernel_create(&init_net, NETLINK_USER, &cfg);
-	if (!data->nl_sk) {
-		pr_err("rpmsg_netlink: Error creating socket.\n");
-		return -10;
+	data->id = bridge_chan_alloc(&chans);
+	if (data->id < 0) {
+		pr_err("rpmsg_netlink: Too many channels.\n");
+		return -ENOSPC;
 	}
 
-	// save netlink socket
+	// fill the skb pool before the first message arrives
+	skb_queue_head_init(&data->pool);
+	INIT_WORK(&data->pool_work, pool_refill_work);
+	mtu = rpmsg_get_mtu(rpdev->ept);
+	data->pool_payload = bridge_genl_msg_size(mtu);
+	if (coalesce_us) {
+		// room for a whole batch, and for one mtu message plus NLMSG_DONE
+		mtu = max_t(int, mtu, coalesce_bytes);
+		data->pool_payload = bridge_genl_msg_size(mtu) + NLMSG_HDRLEN;
+	}
+	pool_refill_work(&data->pool_work);
+
+	spin_lock_init(&data->client_lock);
+	spin_lock_init(&data->batch_lock);
+	hrtimer_init(&data->batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	data->batch_timer.function = batch_timer_cb;
+
+	bridge_route_init(&data->route, route_max, route_timeout_ms);
+
+	if (frag) {
+		ret = bridge_frag_init(&data->frag, &rpdev->dev, frag_max, frag_timeout_ms);
+		if (ret) {
+			pr_err("rpmsg_netlink: Error allocating reassembly buffers.\n");
+			skb_queue_purge(&data->pool);
+			bridge_chan_free(&chans, data->id);
+			return ret;
+		}
+	}
+
+	if (tx_queue) {
+		ret = bridge_tx_init(&data->tx, &rpdev->dev, rpdev->ept, rpdev->dst,
+				     frag ? &data->frag : NULL, tx_queue, tx_coalesce_us);
+		if (ret) {
+			pr_err("rpmsg_netlink: Error allocating tx queue.\n");
+			skb_queue_purge(&data->pool);
+			bridge_chan_free(&chans, data->id);
+			return ret;
+		}
+	}
+
+	if (credits) {
+		bridge_credit_init(&data->credit, min(credits, rx_slots), credit_send);
+	}
+
+	// deliver to userspace off the rpmsg callback
+	snprintf(name, sizeof(name), "rpmsg_nl_rx/%d", data->id);
+	ret = bridge_rx_init(&data->rx, &rpdev->dev, name, rx_slots, rpmsg_get_mtu(rpdev->ept),
+			     rx_prio, rx_deliver);
+	if (ret) {
+		pr_err("rpmsg_netlink: Error starting rx worker.\n");
+		skb_queue_purge(&data->pool);
+		bridge_chan_free(&chans, data->id);
+		return ret;
+	}
+
+	data->dbg = debugfs_create_dir(dev_name(&rpdev->dev), dbg_root);
+	debugfs_create_file("stats", 0444, data->dbg, data, &stats_fops);
+
 	dev_set_drvdata(&rpdev->dev, data);
 
-	msg_cnt = 0;
+	// make the channel reachable from userspace
+	bridge_chan_publish(&chans, data->id, data);
+	bridge_genl_notify(&nl_family, BRIDGE_CMD_CHANNEL_NEW, data->id);
+
+	if (wire) {
+		// the remote learns the address of the channel from it
+		send_wire(data, BRIDGE_WIRE_HELLO, 0, NULL, 0, false);
+	}
+	if (credits) {
+		// the remote sends nothing before the first grant
+		bridge_credit_start(&data->credit);
+	}
 
 	return 0;
 }
@@ -182,7 +1010,27 @@ static int rpmsg_netlink_probe(struct rpmsg_device *rpdev)
 static void rpmsg_netlink_remove(struct rpmsg_device *rpdev)
 {
 	struct driver_data *drv_data = dev_get_drvdata(&rpdev->dev);
-	netlink_kernel_release(drv_data->nl_sk);
+
+	// wait for senders still using the channel, then tear it down
+	bridge_chan_del(&chans, drv_data->id);
+	bridge_genl_notify(&nl_family, BRIDGE_CMD_CHANNEL_DEL, drv_data->id);
+
+	debugfs_remove_recursive(drv_data->dbg);
+	if (credits) {
+		bridge_credit_destroy(&drv_data->credit);
+	}
+	if (tx_queue) {
+		bridge_tx_destroy(&drv_data->tx);
+	}
+	// the channel endpoint is only destroyed by the rpmsg core after remove
+	bridge_rx_destroy(&drv_data->rx, rpdev->ept);
+	hrtimer_cancel(&drv_data->batch_timer);
+	kfree_skb(drv_data->batch);
+	cancel_work_sync(&drv_data->pool_work);
+	skb_queue_purge(&drv_data->pool);
+	bridge_route_destroy(&drv_data->route);
+	bridge_filter_swap(&drv_data->client_filter, NULL);
+	bridge_chan_free(&chans, drv_data->id);
 }
 
 static struct rpmsg_device_id rpmsg_driver_id_table[] = {
@@ -207,8 +1055,34 @@ static struct rpmsg_driver rpmsg_client = {
  */
 static int __init rpmsg_netlink_init(void)
 {
-	pr_info("rpmsg_netlink: ept=%s netlink_id=%d\n", RPMSG_ENDPOINT_NAME, NETLINK_USER);
-	return register_rpmsg_driver(&rpmsg_client);
+	int ret;
+
+	pr_info("rpmsg_netlink: ept=%s genl=%s\n", RPMSG_ENDPOINT_NAME, GENL_NAME);
+
+	ret = bridge_chan_table_init(&chans);
+	if (ret) {
+		return ret;
+	}
+
+	// one family for every channel
+	ret = genl_register_family(&nl_family);
+	if (ret) {
+		bridge_chan_table_destroy(&chans);
+		pr_err("rpmsg_netlink: Error registering the netlink family.\n");
+		return ret;
+	}
+
+	dbg_root = debugfs_create_dir(DRIVER_NAME, NULL);
+
+	ret = register_rpmsg_driver(&rpmsg_client);
+	if (ret) {
+		debugfs_remove_recursive(dbg_root);
+		genl_unregister_family(&nl_family);
+		bridge_chan_table_destroy(&chans);
+		return ret;
+	}
+
+	return 0;
 }
 
 /**
@@ -217,6 +1091,11 @@ static int __init rpmsg_netlink_init(void)
 static void __exit rpmsg_netlink_exit(void)
 {
 	unregister_rpmsg_driver(&rpmsg_client);
+	debugfs_remove_recursive(dbg_root);
+	genl_unregister_family(&nl_family);
+	bridge_chan_table_destroy(&chans);
+	/* filters still being freed */
+	rcu_barrier();
 	pr_info("rpmsg_netlink: Exited module\n");
 }
 